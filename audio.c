@@ -1,27 +1,39 @@
 #include "minigbs.h"
 #include <math.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// the channels' counters are 32.32 fixed point, going up by inc every sample
+// and doing something each time they pass CTR_ONE. unlike float, n samples
+// added at once land exactly where n single ones would, so a stretch that's
+// skipped (a silent channel, fast-forward, a -c checkpoint) leaves a channel
+// in the same state as synthesizing it.
+#define CTR_ONE (UINT64_C(1) << 32)
+#define CTR_F(x) ((x) * (1.0f / 4294967296.0f))
 
 struct chan_len_ctr {
-	int   load;
-	bool  enabled;
-	float counter;
-	float inc;
+	int      load;
+	bool     enabled;
+	uint64_t counter;
+	uint64_t inc;
 };
 
 struct chan_vol_env {
-	int   step;
-	bool  up;
-	float counter;
-	float inc;
+	int      step;
+	bool     up;
+	uint64_t counter;
+	uint64_t inc;
 };
 
 struct chan_freq_sweep {
 	uint16_t freq;
-	int   rate;
-	bool  up;
-	int   shift;
-	float counter;
-	float inc;
+	int      rate;
+	bool     up;
+	int      shift;
+	uint64_t counter;
+	uint64_t inc;
 };
 
 static struct chan {
@@ -34,8 +46,8 @@ static struct chan {
 	int volume_init;
 
 	uint16_t freq;
-	float    freq_counter;
-	float    freq_inc;
+	uint32_t freq_counter; // the fraction, whole steps are taken right away
+	uint64_t freq_inc;
 
 	int val;
 	int note;
@@ -44,8 +56,6 @@ static struct chan {
 	struct chan_vol_env env;
 	struct chan_freq_sweep sweep;
 
-	float capacitor;
-
 	// square
 	int duty;
 	int duty_counter;
@@ -59,36 +69,79 @@ static struct chan {
 	uint8_t sample;
 } chans[4];
 
-#define FREQ 48000.0f
+static float synth_freq;
+static float out_freq;
+static struct resampler* resampler;
 
 static size_t nsamples;
+static size_t nsamples_max;
+static double frame_len; // samples per play call, fractional
+static double frame_acc;
 static float* samples;
-static float* samples_tmp;
+static float* chan_samples[4];
+static bool   chan_written[4];
+static size_t chan_dirty[4]; // samples that may be left nonzero, from the last window written
 static float* sample_ptr;
 static float* sample_end;
 
+#define BATCH_FRAMES 256
+#define HIGH_OVERSAMPLE 4
+#define RAMP_MS 5 // for volume and mute changes
+
 static const int duty_lookup[] = { 0x10, 0x30, 0x3C, 0xCF };
 static float logbase;
-static float charge_factor;
 static float vol_l, vol_r;
 static float audio_rate;
+static float speed = 1.0f; // cfg.speed and cfg.ffwd as of the last CMD_SPEED,
+static int   ffwd  = 1;    // the UI thread owns those
 static bool  muted[4]; // not in chan struct to avoid memset(0) across tracks
+static float chan_gain[4]; // ramps toward muted, applied to the channel before mixing
+static float out_gain;     // ramps toward cfg.volume, applied on the way out
+
+struct spsc    audio_viz;
+uint32_t       audio_viz_track;
+static uint8_t viz_written[0x30]; // register boldness not sent to the UI yet
 static bool paused;
 
 static uint16_t pcm_period_size;
+static uint64_t out_frames; // written since audio_init
+static bool     skipping; // advance channels analytically without output
+
+// register writes made during cpu_frame, applied by synth_frame at the
+// sample matching the cycle they were made on.
+static struct apu_event {
+	uint32_t cycle;
+	uint32_t at; // frame within the synthesis window, set by events_stamp
+	uint16_t addr;
+	uint8_t  val;
+} *events;
+static size_t nevents, nevents_stamped, events_cap;
+
+// register values as of the synthesis position, mem has the cpu's view
+static uint8_t apu_regs[0xFF41 - 0xFF10];
+
+static void audio_apply(uint16_t addr, uint8_t val);
+
+static struct dsp* dsp;
 
-float hipass(struct chan* c, float sample){
-#if 1
-	float out = sample - c->capacitor;
-	c->capacitor = sample - out * charge_factor;
-	return out;
-#else
-	return sample;
-#endif
+// per-sample increment for something happening hz times a second
+static uint64_t ctr_inc(double hz){
+	return llround(hz / synth_freq * CTR_ONE);
+}
+
+// samples a counter can go up by inc before the one that takes it to CTR_ONE
+static size_t ctr_quiet(uint64_t counter, uint64_t inc, size_t n){
+	if(counter >= CTR_ONE){
+		return 0;
+	}
+	if(!inc){
+		return n;
+	}
+	return MIN(n, (size_t)((CTR_ONE - counter - 1) / inc));
 }
 
 void set_note_freq(struct chan* c, float freq){
-	c->freq_inc = freq / FREQ;
+	c->freq_inc = ctr_inc(freq);
 	c->note = MAX(0, (int)roundf(logf(freq/440.0f) / logbase) + 48);
 }
 
@@ -111,7 +164,7 @@ void chan_enable(int i, bool enable){
 void update_env(struct chan* c){
 	c->env.counter += c->env.inc;
 
-	while(c->env.counter > 1.0f){
+	while(c->env.counter >= CTR_ONE){
 		if(c->env.step){
 			c->volume += c->env.up ? 1 : -1;
 			if(c->volume == 0 || c->volume == 15){
@@ -119,38 +172,32 @@ void update_env(struct chan* c){
 			}
 			c->volume = MAX(0, MIN(15, c->volume));
 		}
-		c->env.counter -= 1.0f;
+		c->env.counter -= CTR_ONE;
 	}
 }
 
 void update_len(struct chan* c){
 	if(c->len.enabled){
 		c->len.counter += c->len.inc;
-		if(c->len.counter > 1.0f){
+		if(c->len.counter >= CTR_ONE){
 			chan_enable(c - chans, 0);
-			c->len.counter = 0.0f;
+			c->len.counter = 0;
 		}
 	}
 }
 
-bool update_freq(struct chan* c, float* pos){
-	float inc = c->freq_inc - *pos;
-	c->freq_counter += inc;
-
-	if(c->freq_counter > 1.0f){
-		*pos = c->freq_inc - (c->freq_counter - 1.0f);
-		c->freq_counter = 0.0f;
-		return true;
-	} else {
-		*pos = c->freq_inc;
-		return false;
-	}
+// number of whole freq steps in the next n samples, leaving the fractional part.
+static uint64_t freq_skip(struct chan* c, size_t n){
+	uint64_t frac  = (c->freq_inc & (CTR_ONE - 1)) * n + c->freq_counter;
+	uint64_t steps = (c->freq_inc >> 32) * n + (frac >> 32);
+	c->freq_counter = frac;
+	return steps;
 }
 
 void update_sweep(struct chan* c){
 	c->sweep.counter += c->sweep.inc;
 
-	while(c->sweep.counter > 1.0f){
+	while(c->sweep.counter >= CTR_ONE){
 		if(c->sweep.shift){
 			uint16_t inc = (c->sweep.freq >> c->sweep.shift);
 			if(!c->sweep.up) inc *= -1;
@@ -161,103 +208,422 @@ void update_sweep(struct chan* c){
 			} else {
 				set_note_freq(c, 4194304.0f / (float)((2048 - c->freq) << 5));
 				c->sweep.freq = c->freq;
-				c->freq_inc *= 8.0f;
+				c->freq_inc *= 8;
 			}
 		} else if(c->sweep.rate){
 			c->enabled = 0;
 		}
-		c->sweep.counter -= 1.0f;
+		c->sweep.counter -= CTR_ONE;
 	}
 }
 
-void update_square(bool ch2){
-	struct chan* c = chans + ch2;
-	if(!c->powered) return;
+// one sample of length counter, envelope and sweep. false if the channel is
+// off for it, otherwise the waveform moves on by freq_skip(c, 1).
+static bool chan_tick(struct chan* c){
+	update_len(c);
 
-	set_note_freq(c, 4194304.0f / (float)((2048 - c->freq) << 5));
-	c->freq_inc *= 8.0f;
+	if(!c->enabled){
+		return false;
+	}
+
+	if(c != chans + 2) update_env(c);
+	if(c == chans) update_sweep(c);
+	return true;
+}
 
-	for(int i = 0; i < nsamples; i+=2){
-		update_len(c);
+// how many of the next n samples chan_tick would only add to counters in,
+// which chan_quiet_run can then take all at once
+static size_t chan_quiet(struct chan* c, size_t n){
+	if(c->len.enabled) n = ctr_quiet(c->len.counter, c->len.inc, n);
+	if(!c->enabled) return n;
 
-		if(c->enabled){
-			update_env(c);
-			if(!ch2) update_sweep(c);
+	if(c != chans + 2) n = ctr_quiet(c->env.counter, c->env.inc, n);
+	if(c == chans) n = ctr_quiet(c->sweep.counter, c->sweep.inc, n);
+	return n;
+}
 
-			float pos = 0.0f;
-			float prev_pos = 0.0f;
-			float sample = 0.0f;
+static void chan_quiet_run(struct chan* c, size_t n){
+	if(c->len.enabled) c->len.counter += c->len.inc * n;
+	if(!c->enabled) return;
 
-			while(update_freq(c, &pos)){
-				c->duty_counter = (c->duty_counter + 1) & 7;
-				sample += ((pos - prev_pos) / c->freq_inc) * (float)c->val;
-				c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
-				prev_pos = pos;
+	if(c != chans + 2) c->env.counter += c->env.inc * n;
+	if(c == chans) c->sweep.counter += c->sweep.inc * n;
+}
+
+// the 7 and 15-bit noise sequences laid out in clock order. sum[] holds prefix
+// sums of the +1/-1 output over two periods, so any run of clocks is O(1).
+// all ones isn't part of the sequence: XNOR feedback keeps shifting in ones
+// from there, so index[mask] is len and the callers hold the output instead.
+static struct lfsr_table {
+	uint16_t len;
+	uint16_t mask;
+	uint16_t* state;
+	uint16_t* index;
+	int32_t*  sum;
+} lfsr_tables[2];
+
+static void lfsr_table_init(struct lfsr_table* t, int bits){
+	t->len   = (1 << bits) - 1;
+	t->mask  = t->len;
+	t->state = malloc(t->len * sizeof(uint16_t));
+	t->index = calloc(t->len + 1, sizeof(uint16_t));
+	t->sum   = malloc((t->len * 2 + 1) * sizeof(int32_t));
+
+	uint16_t s = 0;
+	t->sum[0] = 0;
+
+	for(int i = 0; i < t->len * 2; ++i){
+		int bit = !(((s >> (bits - 1)) ^ (s >> (bits - 2))) & 1);
+
+		if(i < t->len){
+			t->state[i] = s;
+			t->index[s] = i;
+		}
+
+		t->sum[i+1] = t->sum[i] + (bit ? 1 : -1);
+		s = ((s << 1) | bit) & t->mask;
+	}
+
+	t->index[t->mask] = t->len;
+}
+
+static inline int lfsr_out(struct lfsr_table* t, uint32_t pos){
+	return t->sum[pos+1] - t->sum[pos];
+}
+
+// sum of n outputs starting at pos
+static inline int64_t lfsr_sum(struct lfsr_table* t, uint32_t pos, uint64_t n){
+	int64_t full = (int64_t)(n / t->len) * t->sum[t->len];
+	return full + t->sum[pos + n % t->len] - t->sum[pos];
+}
+
+// position of the state the next clock will produce, len if locked up
+static uint32_t lfsr_pos(struct chan* c, struct lfsr_table* t){
+	return t->index[((c->lfsr_reg << 1) | (c->val == 1)) & t->mask];
+}
+
+// rebuild lfsr_reg (including the bits above the table width) after n clocks,
+// pos being the position of the state after the last one.
+static void lfsr_sync(struct chan* c, struct lfsr_table* t, uint32_t pos, uint64_t n){
+	uint16_t reg = n < 16 ? c->lfsr_reg << n : 0;
+
+	for(int i = 0; i < MIN(n, 16); ++i){
+		reg |= (t->state[(pos + t->len - i) % t->len] & 1) << i;
+	}
+
+	c->lfsr_reg = reg;
+	c->val = lfsr_out(t, pos);
+}
+
+// lfsr_sync for the lock-up state: every clock was another 1
+static void lfsr_stuck(struct chan* c, uint64_t n){
+	c->lfsr_reg = n < 16 ? (c->lfsr_reg << n) | ((1 << n) - 1) : 0xFFFF;
+	c->val = 1;
+}
+
+static void lfsr_end(struct chan* c, struct lfsr_table* t, uint32_t pos, uint64_t n){
+	if(pos == t->len){
+		lfsr_stuck(c, n);
+	} else {
+		lfsr_sync(c, t, (pos + t->len - 1) % t->len, n);
+	}
+}
+
+// wave RAM decoded to one entry per nibble with the NR32 shift already applied.
+// audio_write keeps it current, so update_wave never has to touch mem.
+static uint8_t wave_table[32];
+
+static void wave_decode(int i, uint8_t val){
+	int shift = chans[2].volume - 1;
+
+	if(shift < 0){
+		wave_table[i*2+0] = wave_table[i*2+1] = 0;
+	} else {
+		wave_table[i*2+0] = (val >> 4) >> shift;
+		wave_table[i*2+1] = (val & 0xF) >> shift;
+	}
+}
+
+static void wave_decode_all(void){
+	for(int i = 0; i < 16; ++i){
+		wave_decode(i, apu_regs[0x20 + i]);
+	}
+}
+
+// true if nothing the channel generates this frame could reach the output.
+static bool chan_silent(struct chan* c){
+	if(!c->enabled || (muted[c-chans] && chan_gain[c-chans] == 0.0f) || !((c->on_left && vol_l) || (c->on_right && vol_r))){
+		return true;
+	}
+
+	if(c->volume){
+		return false;
+	}
+
+	if(c == chans + 2){
+		return true;
+	}
+
+	return !(c->env.up && c->env.step && c->env.inc);
+}
+
+// advance length, envelope, sweep and waveform position across n samples
+// without synthesizing anything, ending up exactly where doing it one sample
+// at a time would.
+static void chan_skip(struct chan* c, size_t n){
+	uint64_t steps = 0;
+
+	while(n){
+		size_t m = chan_quiet(c, n);
+		chan_quiet_run(c, m);
+		if(c->enabled) steps += freq_skip(c, m);
+		n -= m;
+
+		if(n){
+			if(chan_tick(c)) steps += freq_skip(c, 1);
+			n--;
+		}
+	}
+
+	if(!steps){
+		return;
+	}
+
+	if(c < chans + 2){
+		c->duty_counter = (c->duty_counter + steps) & 7;
+		c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
+	} else if(c == chans + 2){
+		c->val = (c->val + steps) & 31;
+	} else {
+		struct lfsr_table* t = lfsr_tables + c->lfsr_wide;
+		uint32_t pos = lfsr_pos(c, t);
+		lfsr_end(c, t, pos == t->len ? pos : (pos + steps) % t->len, steps);
+	}
+}
+
+// QUALITY_FAST: take each channel's level at the sample point instead of
+// integrating across the whole sample. between length, envelope and sweep
+// events nothing but the waveform position moves, so those runs get a loop
+// of their own with the levels worked out once.
+static bool update_fast(struct chan* c, float* out, size_t from, size_t to){
+	struct lfsr_table* t = lfsr_tables + c->lfsr_wide;
+	uint32_t lfsr = lfsr_pos(c, t);
+	uint64_t clocks = 0;
+
+	for(size_t i = from; i < to;){
+		size_t n = chan_quiet(c, (to - i) / 2);
+		chan_quiet_run(c, n);
+
+		if(!c->enabled){
+			i += n * 2;
+		} else {
+			size_t end = i + n * 2;
+			uint32_t counter = c->freq_counter;
+			uint64_t inc = c->freq_inc;
+			float l = 0.25f * c->on_left * vol_l;
+			float r = 0.25f * c->on_right * vol_r;
+
+			if(c < chans + 2){
+				float gain = c->volume / 15.0f;
+				int duty = c->duty_counter;
+
+				for(; i < end; i+=2){
+					uint64_t acc = counter + inc;
+					counter = acc;
+					if(acc >> 32){
+						duty = (duty + (acc >> 32)) & 7;
+						c->val = (c->duty & (1 << duty)) ? 1 : -1;
+					}
+					out[i+0] = c->val * gain * l;
+					out[i+1] = c->val * gain * r;
+				}
+
+				c->duty_counter = duty;
+			} else if(c == chans + 2){
+				float diff = c->volume ? (float[]){ 7.5f, 3.75f, 1.5f }[c->volume - 1] : 0.0f;
+
+				for(; i < end; i+=2){
+					uint64_t acc = counter + inc;
+					counter = acc;
+					c->val = (c->val + (acc >> 32)) & 31;
+					if(c->volume){
+						float sample = (wave_table[c->val] - diff) / 7.5f;
+						out[i+0] = sample * l;
+						out[i+1] = sample * r;
+					}
+				}
+			} else {
+				float gain = c->volume / 15.0f;
+
+				for(; i < end; i+=2){
+					uint64_t acc = counter + inc;
+					uint64_t steps = acc >> 32;
+					counter = acc;
+					if(steps && lfsr != t->len){
+						lfsr = (lfsr + steps - 1) % t->len;
+						c->val = lfsr_out(t, lfsr);
+						lfsr = (lfsr + 1) % t->len;
+					}
+					clocks += steps;
+					out[i+0] = c->val * gain * l;
+					out[i+1] = c->val * gain * r;
+				}
 			}
-			sample += ((pos - prev_pos) / c->freq_inc) * (float)c->val;
-			sample = hipass(c, sample * (c->volume / 15.0f));
 
-			if(!muted[c-chans]){
-				samples[i+0] += sample * 0.25f * c->on_left * vol_l;
-				samples[i+1] += sample * 0.25f * c->on_right * vol_r;
+			c->freq_counter = counter;
+		}
+
+		if(i >= to){
+			break;
+		}
+
+		// a sample with an event in it
+		if(!chan_tick(c)){
+			i += 2;
+			continue;
+		}
+
+		uint64_t steps = freq_skip(c, 1);
+		float sample;
+
+		if(c < chans + 2){
+			if(steps){
+				c->duty_counter = (c->duty_counter + steps) & 7;
+				c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
+			}
+			sample = c->val * (c->volume / 15.0f);
+		} else if(c == chans + 2){
+			c->val = (c->val + steps) & 31;
+			if(!c->volume){
+				i += 2;
+				continue;
 			}
+			float diff = (float[]){ 7.5f, 3.75f, 1.5f }[c->volume - 1];
+			sample = (wave_table[c->val] - diff) / 7.5f;
+		} else {
+			if(steps && lfsr != t->len){
+				lfsr = (lfsr + steps - 1) % t->len;
+				c->val = lfsr_out(t, lfsr);
+				lfsr = (lfsr + 1) % t->len;
+			}
+			clocks += steps;
+			sample = c->val * (c->volume / 15.0f);
 		}
+
+		out[i+0] = sample * 0.25f * c->on_left * vol_l;
+		out[i+1] = sample * 0.25f * c->on_right * vol_r;
+		i += 2;
 	}
+
+	if(clocks){
+		lfsr_end(c, t, lfsr, clocks);
+	}
+
+	return true;
 }
 
-static uint8_t wave_sample(int pos, int volume){
-	uint8_t sample = mem[0xFF30 + pos / 2];
-	if(pos & 1){
-		sample &= 0xF;
-	} else {
-		sample >>= 4;
+bool update_square(bool ch2, size_t from, size_t to){
+	struct chan* c = chans + ch2;
+	float* out = chan_samples[ch2];
+	if(!c->powered) return false;
+
+	set_note_freq(c, 4194304.0f / (float)((2048 - c->freq) << 5));
+	c->freq_inc *= 8;
+
+	if(skipping || chan_silent(c)){
+		chan_skip(c, (to - from) / 2);
+		return false;
+	}
+
+	if(cfg.quality == QUALITY_FAST){
+		return update_fast(c, out, from, to);
+	}
+
+	for(size_t i = from; i < to; i+=2){
+		if(chan_tick(c)){
+			uint32_t start = c->freq_counter;
+			uint64_t steps = freq_skip(c, 1);
+			float sample = c->val;
+
+			// each level weighted by how much of the sample it lasted
+			if(steps){
+				sample = (1.0f - CTR_F(start)) * c->val;
+
+				for(uint64_t k = 1; k <= steps; ++k){
+					c->duty_counter = (c->duty_counter + 1) & 7;
+					c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
+					sample += (k < steps ? 1.0f : CTR_F(c->freq_counter)) * c->val;
+				}
+
+				sample /= CTR_F((float)c->freq_inc);
+			}
+
+			sample *= c->volume / 15.0f;
+
+			out[i+0] = sample * 0.25f * c->on_left * vol_l;
+			out[i+1] = sample * 0.25f * c->on_right * vol_r;
+		}
 	}
-	return volume ? (sample >> (volume-1)) : 0;
+
+	return true;
 }
 
-void update_wave(void){
+bool update_wave(size_t from, size_t to){
 	struct chan* c = chans + 2;
-	if(!c->powered) return;
+	float* out = chan_samples[2];
+	if(!c->powered) return false;
 
 	float freq = 4194304.0f / (float)((2048 - c->freq) << 5);
 	set_note_freq(c, freq);
 
-	c->freq_inc *= 16.0f;
+	c->freq_inc *= 16;
 
-	for(int i = 0; i < nsamples; i+=2){
-		update_len(c);
+	if(skipping || chan_silent(c)){
+		chan_skip(c, (to - from) / 2);
+		return false;
+	}
+
+	if(cfg.quality == QUALITY_FAST){
+		return update_fast(c, out, from, to);
+	}
 
-		if(c->enabled){
-			float pos = 0.0f;
-			float prev_pos = 0.0f;
-			float sample = 0.0f;
+	for(size_t i = from; i < to; i+=2){
+		if(chan_tick(c)){
+			uint32_t start = c->freq_counter;
+			uint64_t steps = freq_skip(c, 1);
 
-			c->sample = wave_sample(c->val, c->volume);
+			c->sample = wave_table[c->val];
+			float sample = c->sample;
+
+			if(steps){
+				sample = (1.0f - CTR_F(start)) * c->sample;
+
+				for(uint64_t k = 1; k <= steps; ++k){
+					c->val = (c->val + 1) & 31;
+					c->sample = wave_table[c->val];
+					sample += (k < steps ? 1.0f : CTR_F(c->freq_counter)) * c->sample;
+				}
 
-			while(update_freq(c, &pos)){
-				c->val = (c->val + 1) & 31;
-				sample += ((pos - prev_pos) / c->freq_inc) * (float)c->sample;
-				c->sample = wave_sample(c->val, c->volume);
-				prev_pos = pos;
+				sample /= CTR_F((float)c->freq_inc);
 			}
-			sample += ((pos - prev_pos) / c->freq_inc) * (float)c->sample;
 
 			if(c->volume > 0){
 				float diff = (float[]){ 7.5f, 3.75f, 1.5f }[c->volume - 1];
-				sample = hipass(c, (sample - diff) / 7.5f);
+				sample = (sample - diff) / 7.5f;
 
-				if(!muted[c-chans]){
-					samples[i+0] += sample * 0.25f * c->on_left * vol_l;
-					samples[i+1] += sample * 0.25f * c->on_right * vol_r;
-				}
+				out[i+0] = sample * 0.25f * c->on_left * vol_l;
+				out[i+1] = sample * 0.25f * c->on_right * vol_r;
 			}
 		}
 	}
+
+	return true;
 }
 
-void update_noise(void){
+bool update_noise(size_t from, size_t to){
 	struct chan* c = chans + 3;
-	if(!c->powered) return;
+	float* out = chan_samples[3];
+	if(!c->powered) return false;
 
 	float freq = 4194304.0f / (float)((size_t[]){ 8, 16, 32, 48, 64, 80, 96, 112 }[c->lfsr_div] << (size_t)c->freq);
 	set_note_freq(c, freq);
@@ -266,36 +632,53 @@ void update_noise(void){
 		c->enabled = false;
 	}
 
-	for(int i = 0; i < nsamples; i+=2){
-		update_len(c);
-
-		if(c->enabled){
-			update_env(c);
-
-			float pos = 0.0f;
-			float prev_pos = 0.0f;
-			float sample = 0.0f;
+	if(skipping || chan_silent(c)){
+		chan_skip(c, (to - from) / 2);
+		return false;
+	}
 
-			while(update_freq(c, &pos)){
-				c->lfsr_reg = (c->lfsr_reg << 1) | (c->val == 1);
+	if(cfg.quality == QUALITY_FAST){
+		return update_fast(c, out, from, to);
+	}
 
-				if(c->lfsr_wide){
-					c->val = !(((c->lfsr_reg >> 14) & 1) ^ ((c->lfsr_reg >> 13) & 1)) ? 1 : -1;
-				} else {
-					c->val = !(((c->lfsr_reg >> 6 ) & 1) ^ ((c->lfsr_reg >> 5 ) & 1)) ? 1 : -1;
-				}
-				sample += ((pos - prev_pos) / c->freq_inc) * c->val;
-				prev_pos = pos;
+	struct lfsr_table* t = lfsr_tables + c->lfsr_wide;
+	uint32_t lfsr = lfsr_pos(c, t);
+	uint64_t clocks = 0;
+
+	for(size_t i = from; i < to; i+=2){
+		if(chan_tick(c)){
+			float start = CTR_F(c->freq_counter);
+			uint64_t steps = freq_skip(c, 1);
+			float sample = c->val;
+
+			// each span up to a clock takes the value that clock produces, whole
+			// spans come from the prefix sums, the trailing partial keeps the last.
+			// locked up, every clock produces the 1 c->val already holds.
+			if(steps && lfsr != t->len){
+				int first = lfsr_out(t, lfsr);
+				int64_t mid = lfsr_sum(t, (lfsr + 1) % t->len, steps - 1);
+				lfsr = (lfsr + steps - 1) % t->len;
+				int last = lfsr_out(t, lfsr);
+
+				sample = ((1.0f - start) * first + mid + CTR_F(c->freq_counter) * last) / CTR_F((float)c->freq_inc);
+
+				c->val = last;
+				lfsr = (lfsr + 1) % t->len;
 			}
-			sample += ((pos - prev_pos) / c->freq_inc) * c->val;
-			sample = hipass(c, sample * (c->volume / 15.0f));
+			clocks += steps;
 
-			if(!muted[c-chans]){
-				samples[i+0] += sample * 0.25f * c->on_left * vol_l;
-				samples[i+1] += sample * 0.25f * c->on_right * vol_r;
-			}
+			sample *= c->volume / 15.0f;
+
+			out[i+0] = sample * 0.25f * c->on_left * vol_l;
+			out[i+1] = sample * 0.25f * c->on_right * vol_r;
 		}
 	}
+
+	if(clocks){
+		lfsr_end(c, t, lfsr, clocks);
+	}
+
+	return true;
 }
 
 bool audio_mute(int chan, int val){
@@ -303,96 +686,784 @@ bool audio_mute(int chan, int val){
 	return muted[chan-1];
 }
 
+// synthesize [from, to) of the frame for every channel
+static void synth_range(size_t from, size_t to){
+	chan_written[0] |= update_square(0, from, to);
+	chan_written[1] |= update_square(1, from, to);
+	chan_written[2] |= update_wave(from, to);
+	chan_written[3] |= update_noise(from, to);
+}
+
+// length of the next play call in samples, carrying the fractional part of
+// frame_len so play calls don't drift against the output clock.
+static size_t frame_next(void){
+	frame_acc += frame_len;
+	size_t n = frame_acc;
+	frame_acc -= n;
+	return n;
+}
+
+// convert the cycle stamps of writes made by the play call that just ran,
+// which covers [base, base + len) of the window, into sample positions.
+static void events_stamp(size_t base, size_t len){
+	const double cycle_to_sample = synth_freq / (4194304.0 * speed);
+
+	for(struct apu_event* e = events + nevents_stamped; e < events + nevents; ++e){
+		e->at = base + MIN((size_t)(e->cycle * cycle_to_sample), len);
+	}
+	nevents_stamped = nevents;
+}
+
+// fast-forward: run a play call without synthesizing it, returns its length.
+// its register writes are still applied in order, with the channels
+// advanced analytically in between, so the next audible window picks up
+// where the song would really be.
+static size_t play_skip(void){
+	skipping = true;
+
+	uint64_t t = stats_now();
+	cpu_frame();
+	stats.cpu_ns += stats_now() - t;
+	stats.cpu_frames++;
+
+	size_t len = frame_next();
+	events_stamp(0, len);
+
+	size_t from = 0;
+	for(struct apu_event* e = events; e < events + nevents; ++e){
+		if(e->at > from){
+			synth_range(from * 2, e->at * 2);
+			from = e->at;
+		}
+		audio_apply(e->addr, e->val);
+	}
+	nevents = nevents_stamped = 0;
+
+	if(from < len){
+		synth_range(from * 2, len * 2);
+	}
+
+	skipping = false;
+	return len;
+}
+
+// run n samples worth of play calls that way
+static void window_skip(size_t n){
+	size_t frames = 0;
+
+	while(frames < n){
+		frames += play_skip();
+	}
+}
+
+// run play calls back-to-back until the window is at least BATCH_FRAMES
+// long, so timer-driven drivers playing at kHz rates pay for one synthesis
+// pass per window instead of one per call. at normal rates this is one call.
+// returns the window's length, its writes are left stamped in events.
+static size_t window_cpu(void){
+	const size_t max = nsamples_max / 2;
+	size_t frames = 0;
+
+	do {
+		uint64_t t = stats_now();
+		cpu_frame();
+		stats.cpu_ns += stats_now() - t;
+		stats.cpu_frames++;
+
+		size_t n = MIN(frame_next(), max - frames);
+		events_stamp(frames, n);
+		frames += n;
+	} while(frames < BATCH_FRAMES && frames + frame_len < max);
+
+	return frames;
+}
+
+static void window_start(size_t frames){
+	nsamples   = frames * 2;
+	sample_ptr = samples;
+	sample_end = samples + nsamples;
+}
+
+static void window_run(void){
+	// only one window in every ffwd is heard, at normal pitch
+	if(ffwd > 1){
+		window_skip((ffwd - 1) * MAX((size_t)frame_len, (size_t)BATCH_FRAMES));
+	}
+
+	window_start(window_cpu());
+}
+
 void audio_reset(void){
 	memset(chans, 0, sizeof(chans));
-	memset(samples, 0, nsamples * sizeof(float));
+	nevents = nevents_stamped = 0;
+
+	// start with one frame of silence
+	frame_acc  = 0.0;
+	nsamples   = frame_next() * 2;
 	sample_ptr = samples;
 	sample_end = samples + nsamples;
+	memset(samples, 0, nsamples * sizeof(float));
+	for(int i = 0; i < 4; ++i){
+		stems_push(i, NULL, nsamples / 2);
+	}
 	chans[0].val = chans[1].val = -1;
+	wave_decode_all();
+
+	for(int i = 0; i < 4; ++i){
+		chan_gain[i] = muted[i] ? 0.0f : 1.0f;
+	}
+
+	if(resampler){
+		resampler_reset(resampler);
+	}
+
+	dsp_reset(dsp);
 }
 
 void audio_pause(bool p){
-	paused = p;
+	__atomic_store_n(&paused, p, __ATOMIC_RELEASE);
 }
 
-float audio_update(struct pollfd* fds, int nfds){
-	static float* buf = NULL;
-	const size_t bufsz = (pcm_period_size*2) * sizeof(float);
+static void synth_frame(const struct apu_event* events, size_t nevents){
+	// clear all of what was written, which a window shorter than the last one
+	// wouldn't cover. the channels only write samples while enabled.
+	for(int i = 0; i < 4; ++i){
+		if(chan_dirty[i]){
+			memset(chan_samples[i], 0, chan_dirty[i] * sizeof(float));
+			chan_dirty[i] = 0;
+		}
+		chan_written[i] = false;
+	}
+
+	// play register writes at the point in the window the cpu made them
+	size_t from = 0;
+
+	for(const struct apu_event* e = events; e < events + nevents; ++e){
+		size_t at = e->at * 2;
 
-	if(!buf){
-		buf = malloc(bufsz);
+		if(at > from){
+			synth_range(from, at);
+			from = at;
+		}
+
+		audio_apply(e->addr, e->val);
 	}
 
-	float* p = buf;
-	float* end = buf + (bufsz/sizeof(float));
+	if(from < nsamples){
+		synth_range(from, nsamples);
+	}
 
-	if(!audio_output_ready(fds, nfds)) {
-		return 0;
+	for(int i = 0; i < 4; ++i){
+		if(chan_written[i]) chan_dirty[i] = nsamples;
+	}
+
+	// mutes fade here, the last point the channels are apart
+	for(int i = 0; i < 4; ++i){
+		float target = muted[i] ? 0.0f : 1.0f;
+
+		if(chan_gain[i] != target){
+			stats_heard((stats.delay + stats.ahead_frames) * 1000.0 / out_freq);
+		}
+
+		if(chan_written[i]){
+			dsp_gain(chan_gain + i, target, 1000.0f / (RAMP_MS * synth_freq), chan_samples[i], nsamples / 2);
+		} else {
+			chan_gain[i] = target;
+		}
+	}
+
+	// the UI gets a copy, if it's keeping up
+	struct Viz* viz = audio_viz.buf ? spsc_slot(&audio_viz) : NULL;
+	if(viz){
+		size_t frames = nsamples / 2;
+		size_t skip = frames > VIZ_OSC ? frames - VIZ_OSC : 0;
+
+		for(int i = 0; i < 4; ++i){
+			const float* p = chan_samples[i] + skip * 2;
+			for(size_t j = 0; j < frames - skip; ++j){
+				viz->osc[i][j] = (p[j*2] + p[j*2+1]) / 2.0f;
+			}
+		}
+		viz->osc_count = frames - skip;
+
+		audio_get_notes(viz->notes);
+		audio_get_vol(viz->vol);
+		memcpy(viz->regs, mem + 0xFF10, sizeof(viz->regs));
+		memcpy(viz->written, viz_written, sizeof(viz->written));
+		memset(viz_written, 0, sizeof(viz_written));
+		viz->track = audio_viz_track;
+
+		spsc_push(&audio_viz);
+	}
+
+	bool audible = false;
+
+	for(int i = 0; i < 4; ++i){
+		stems_push(i, chan_written[i] ? chan_samples[i] : NULL, nsamples / 2);
+
+		if(!chan_written[i]){
+			continue;
+		}
+
+		if(audible){
+			for(size_t j = 0; j < nsamples; ++j) samples[j] += chan_samples[i][j];
+		} else {
+			memcpy(samples, chan_samples[i], nsamples * sizeof(float));
+			audible = true;
+		}
+	}
+
+	// all four channels silent and the filters settled, the frame is just zeros
+	if(!audible){
+		memset(samples, 0, nsamples * sizeof(float));
+		if(dsp_idle(dsp)) return;
+	}
+
+	dsp_run(dsp, samples, nsamples / 2);
+}
+
+// Pipeline: for offline renders, a thread of its own can run the cpu ahead
+// and hand each window's length and register writes over through a ring,
+// while this side synthesizes them. Nothing else is shared, except NR52's
+// channel bits, which synthesis sets and the cpu may read. Touching NR52
+// waits for synthesis to catch up first, so the cpu sees it exactly as it
+// would have running in turn.
+
+#define PIPE_WINDOWS 16
+
+struct pipe_window {
+	size_t frames;
+	struct apu_event* events; // swapped with the cpu's, not copied
+	size_t nevents, cap;
+};
+
+static struct spsc pipeline;
+static int         pipe_data_fd;  // a window was pushed
+static int         pipe_space_fd; // a window was synthesized
+static bool        pipe_quit;
+
+void audio_pipeline_start(void){
+	spsc_init(&pipeline, sizeof(struct pipe_window), PIPE_WINDOWS);
+
+	for(size_t i = 0; i <= pipeline.mask; ++i){
+		struct pipe_window* w = (struct pipe_window*)(pipeline.buf + i * pipeline.elem);
+		w->cap    = 1024;
+		w->events = malloc(w->cap * sizeof(*w->events));
+	}
+
+	pipe_data_fd  = eventfd(0, 0);
+	pipe_space_fd = eventfd(0, 0);
+	pipe_quit     = false;
+}
+
+// cpu thread: run one window into the ring, false once stopped
+bool audio_pipeline_cpu(void){
+	struct pipe_window* w;
+	eventfd_t n;
+
+	while(!(w = spsc_slot(&pipeline))){
+		if(__atomic_load_n(&pipe_quit, __ATOMIC_ACQUIRE)) return false;
+		eventfd_read(pipe_space_fd, &n);
+	}
+
+	size_t frames = window_cpu();
+	if(__atomic_load_n(&pipe_quit, __ATOMIC_ACQUIRE)){
+		return false;
+	}
+
+	struct apu_event* e = w->events;
+	size_t cap = w->cap;
+
+	w->frames  = frames;
+	w->events  = events;
+	w->nevents = nevents;
+	w->cap     = events_cap;
+
+	events     = e;
+	events_cap = cap;
+	nevents    = nevents_stamped = 0;
+
+	spsc_push(&pipeline);
+	eventfd_write(pipe_data_fd, 1);
+	return true;
+}
+
+// cpu thread: wait until everything pushed so far has been synthesized
+void audio_sync(void){
+	eventfd_t n;
+
+	while(pipeline.buf && spsc_count(&pipeline) && !__atomic_load_n(&pipe_quit, __ATOMIC_ACQUIRE)){
+		eventfd_read(pipe_space_fd, &n);
+	}
+}
+
+// have the cpu thread return, it has to be joined before this is called
+void audio_pipeline_stop(void){
+	__atomic_store_n(&pipe_quit, true, __ATOMIC_RELEASE);
+	eventfd_write(pipe_space_fd, 1);
+}
+
+void audio_pipeline_free(void){
+	for(size_t i = 0; i <= pipeline.mask; ++i){
+		free(((struct pipe_window*)(pipeline.buf + i * pipeline.elem))->events);
+	}
+
+	spsc_free(&pipeline);
+	close(pipe_data_fd);
+	close(pipe_space_fd);
+}
+
+// synthesize the next window, taking it from the pipeline if there is one
+static void window_next(void){
+	struct pipe_window* w = NULL;
+
+	if(pipeline.buf){
+		eventfd_t n;
+		while(!(w = spsc_peek(&pipeline))){
+			eventfd_read(pipe_data_fd, &n);
+		}
+		window_start(w->frames);
+	} else {
+		window_run();
 	}
 
+	uint64_t t = stats_now();
+	if(w){
+		synth_frame(w->events, w->nevents);
+	} else {
+		synth_frame(events, nevents);
+		nevents = nevents_stamped = 0;
+	}
+	stats.synth_ns += stats_now() - t;
+	stats.synth_windows++;
+
+	if(w){
+		spsc_pop(&pipeline);
+		eventfd_write(pipe_space_fd, 1);
+	}
+}
+
+// fill frames of output at p
+static void audio_render(float* p, size_t frames){
+	float* end = p + frames * 2;
+
 	if(paused){
-		memset(buf, 0, bufsz);
-		goto out;
+		memset(p, 0, frames * 2 * sizeof(float));
+		return;
 	}
 
 	while(end - p){
 		if(sample_ptr == sample_end){
-			cpu_frame();
+			window_next();
+		}
+
+		if(resampler){
+			size_t in = (sample_end - sample_ptr) / 2;
+			size_t n = resampler_run(resampler, sample_ptr, &in, p, (end - p) / 2);
+			sample_ptr += in * 2;
+			p += n * 2;
+		} else {
+			int n = MIN(end - p, sample_end - sample_ptr);
+			memcpy(p, sample_ptr, n * sizeof(float));
+			sample_ptr += n;
+			p += n;
+		}
+	}
+}
+
+// Render-ahead: a producer thread fills a ring of blocks as far ahead as
+// lookahead_ms, and the output side only copies from it, so a slow cpu_frame
+// is absorbed by the ring instead of the device buffer. Track changes bump
+// the generation, and the output drops blocks from before it. Pausing keeps
+// the blocks, the output just stops taking them until it's resumed.
+
+#define AHEAD_BLOCK 256
+
+struct ahead_block {
+	uint32_t gen;
+	uint16_t frames; // 0 marks the end of -t
+	float    samples[AHEAD_BLOCK * 2];
+};
+
+static struct spsc ahead;
+static uint32_t    ahead_gen;      // written by the producer only
+static size_t      ahead_off;      // frames of the oldest block already played
+static bool        ahead_ended;
+static int         ahead_space_fd; // made readable when the output frees blocks
+
+// returns an fd that's readable once there's room to render more
+int audio_ahead_start(int ms){
+	size_t blocks = MAX((size_t)1, (size_t)ceilf(ms * out_freq / 1000.0f / AHEAD_BLOCK));
+
+	spsc_init(&ahead, sizeof(struct ahead_block), blocks);
+	ahead_space_fd = eventfd(0, EFD_NONBLOCK);
+	stats.ahead_min = blocks * AHEAD_BLOCK;
+
+	return ahead_space_fd;
+}
+
+// render one block if there's room and not paused, returns how many ms
+double audio_ahead_fill(void){
+	struct ahead_block* b = spsc_slot(&ahead);
+	if(!b || paused){
+		return 0;
+	}
+
+	audio_render(b->samples, AHEAD_BLOCK);
+	b->gen = ahead_gen;
+	b->frames = AHEAD_BLOCK;
+	spsc_push(&ahead);
 
-			memset(samples    , 0, nsamples * sizeof(float));
-			memset(samples_tmp, 0, nsamples * sizeof(float));
+	return AHEAD_BLOCK * 1000.0 / out_freq;
+}
+
+// have the output skip what's been rendered so far
+void audio_ahead_flush(void){
+	__atomic_store_n(&ahead_gen, ahead_gen + 1, __ATOMIC_RELEASE);
+}
+
+// mark the end of the render, false if there's no room yet
+bool audio_ahead_end(void){
+	struct ahead_block* b = spsc_slot(&ahead);
+	if(!b){
+		return false;
+	}
+
+	b->gen = ahead_gen;
+	b->frames = 0;
+	spsc_push(&ahead);
+	return true;
+}
+
+// whether the output has played up to the end mark
+bool audio_ahead_done(void){
+	return ahead_ended;
+}
+
+static void ahead_read(float* p, size_t frames){
+	uint32_t gen = __atomic_load_n(&ahead_gen, __ATOMIC_ACQUIRE);
+	bool popped = false;
+	bool dropped = false;
+
+	// what's rendered ahead is where the song is, so hold on to it
+	if(__atomic_load_n(&paused, __ATOMIC_ACQUIRE)){
+		memset(p, 0, frames * 2 * sizeof(float));
+		return;
+	}
 
-			update_square(0);
-			ui_osc_draw(0, samples, nsamples);
+	while(frames){
+		struct ahead_block* b = spsc_peek(&ahead);
 
-			for(size_t i = 0; i < nsamples; ++i) samples_tmp[i] += samples[i];
-			memset(samples, 0, nsamples * sizeof(float));
+		if(b && b->gen != gen){
+			spsc_pop(&ahead);
+			ahead_off = 0;
+			popped = dropped = true;
+			continue;
+		}
 
-			update_square(1);
-			ui_osc_draw(1, samples, nsamples);
+		if(!b || !b->frames){
+			// out of blocks is an underrun, unless they were just dropped
+			if(!b && !dropped) stats.ahead_underruns++;
+			if(b) ahead_ended = true;
 
-			for(size_t i = 0; i < nsamples; ++i) samples_tmp[i] += samples[i];
-			memset(samples, 0, nsamples * sizeof(float));
+			memset(p, 0, frames * 2 * sizeof(float));
+			break;
+		}
 
-			update_wave();
-			ui_osc_draw(2, samples, nsamples);
+		size_t n = MIN(frames, b->frames - ahead_off);
+		memcpy(p, b->samples + ahead_off * 2, n * 2 * sizeof(float));
+		p += n * 2;
+		frames -= n;
+		ahead_off += n;
 
-			for(size_t i = 0; i < nsamples; ++i) samples_tmp[i] += samples[i];
-			memset(samples, 0, nsamples * sizeof(float));
+		if(ahead_off == b->frames){
+			spsc_pop(&ahead);
+			ahead_off = 0;
+			popped = true;
+		}
+	}
 
-			update_noise();
-			ui_osc_draw(3, samples, nsamples);
+	if(popped){
+		eventfd_write(ahead_space_fd, 1);
+	}
 
-			for(size_t i = 0; i < nsamples; ++i) samples[i] += samples_tmp[i];
+	stats.ahead_frames = spsc_count(&ahead) * AHEAD_BLOCK - ahead_off;
+	if(!dropped){
+		stats.ahead_min = MIN(stats.ahead_min, stats.ahead_frames);
+	}
+}
+
+// Chunked rendering: for long offline renders, the cpu alone runs through
+// the song with the channels advanced analytically, like fast-forward does,
+// and forks a process at each chunk boundary that renders that chunk for
+// real. Those run on all cores while the parent writes the chunks out in
+// order. Each starts a pre-roll early so the filters and the resampler have
+// settled by the boundary, and runs on past it so the seam can crossfade
+// from the previous chunk's own continuation.
+
+#define CHUNK_S          10
+#define CHUNK_PREROLL_MS 500
+#define CHUNK_XFADE_MS   10
+
+struct chunk {
+	pid_t  pid; // 0 once collected
+	float* buf; // shared with the child, chunk_len + chunk_xfade frames
+};
 
-			for(size_t i = 0; i < nsamples; ++i){
-				samples[i] *= cfg.volume;
+static struct chunk* chunks;
+static int      chunk_jobs;
+static size_t   chunk_len, chunk_preroll, chunk_xfade; // output frames
+static uint64_t chunk_forked;    // chunks handed out so far
+static uint64_t chunk_cur;       // the one being played
+static size_t   chunk_off;       // frames of it already played
+static uint64_t chunk_synth_pos; // synth frames the parent's cpu has run through
+static float*   chunk_tail;      // the previous chunk's run past the seam
+
+// a chunk that's missing can't be made up for, and silence in its place
+// would pass for a finished render. stop with an error instead.
+static void chunk_fail(uint64_t k){
+	fprintf(stderr, "Rendering chunk %" PRIu64 " failed, the output is incomplete.\n", k);
+	audio_chunks_stop();
+	exit(1);
+}
+
+static void chunk_fork(void){
+	uint64_t k = chunk_forked++;
+	uint64_t start = k * chunk_len;
+	double step = synth_freq / (double)out_freq;
+	struct chunk* c = chunks + k % chunk_jobs;
+
+	// the first chunk starts where a serial render would, exactly
+	if(k){
+		double target = (start - chunk_preroll) * step;
+		while(chunk_synth_pos + frame_len < target){
+			chunk_synth_pos += play_skip();
+		}
+	}
+
+	c->pid = fork();
+	if(c->pid == -1){
+		perror("fork");
+		chunk_fail(k);
+	}
+	if(c->pid){
+		return;
+	}
+
+	// the output frame the child's first one lines up with
+	uint64_t first = 0;
+
+	if(k){
+		first = ceil(chunk_synth_pos / step);
+		sample_ptr = sample_end = samples;
+		dsp_reset(dsp);
+
+		if(resampler){
+			resampler_reset(resampler);
+			resampler_skip(resampler, first * step - chunk_synth_pos);
+		}
+	}
+
+	for(uint64_t n = start - MIN(start, first); n; ){
+		size_t m = MIN(n, chunk_len);
+		audio_render(c->buf, m);
+		n -= m;
+	}
+
+	audio_render(c->buf, chunk_len + chunk_xfade);
+	_exit(0);
+}
+
+// call after audio_reset and song_start, instead of rendering directly
+void audio_chunks_start(int jobs){
+	chunk_jobs    = jobs;
+	chunk_len     = CHUNK_S * out_freq;
+	chunk_preroll = CHUNK_PREROLL_MS * out_freq / 1000;
+	chunk_xfade   = CHUNK_XFADE_MS * out_freq / 1000;
+
+	chunks     = calloc(jobs, sizeof(*chunks));
+	chunk_tail = calloc(chunk_xfade * 2, sizeof(float));
+
+	chunk_forked = chunk_cur = chunk_off = 0;
+	chunk_synth_pos = nsamples / 2; // the silence audio_reset left
+
+	for(int i = 0; i < jobs; ++i){
+		chunks[i].buf = mmap(NULL, (chunk_len + chunk_xfade) * 2 * sizeof(float),
+		                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if(chunks[i].buf == MAP_FAILED){
+			perror("mmap");
+			exit(1);
+		}
+	}
+
+	for(int i = 0; i < jobs; ++i){
+		chunk_fork();
+	}
+}
+
+void audio_chunks_stop(void){
+	for(int i = 0; i < chunk_jobs; ++i){
+		if(chunks[i].pid > 0){
+			kill(chunks[i].pid, SIGKILL);
+			waitpid(chunks[i].pid, NULL, 0);
+		}
+		munmap(chunks[i].buf, (chunk_len + chunk_xfade) * 2 * sizeof(float));
+	}
+
+	free(chunks);
+	free(chunk_tail);
+	chunks = NULL;
+}
+
+static void chunk_read(float* p, size_t frames){
+	while(frames){
+		struct chunk* c = chunks + chunk_cur % chunk_jobs;
+
+		if(c->pid){
+			int status;
+			pid_t pid = waitpid(c->pid, &status, 0);
+			c->pid = 0;
+
+			if(pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status)){
+				chunk_fail(chunk_cur);
+			}
+
+			if(chunk_cur){
+				for(size_t i = 0; i < chunk_xfade * 2; ++i){
+					float t = (i / 2 + 1) / (float)(chunk_xfade + 1);
+					c->buf[i] = chunk_tail[i] + (c->buf[i] - chunk_tail[i]) * t;
+				}
 			}
+		}
+
+		size_t n = MIN(frames, chunk_len - chunk_off);
+		memcpy(p, c->buf + chunk_off * 2, n * 2 * sizeof(float));
+		p += n * 2;
+		frames -= n;
+		chunk_off += n;
+
+		if(chunk_off == chunk_len){
+			memcpy(chunk_tail, c->buf + chunk_len * 2, chunk_xfade * 2 * sizeof(float));
+			chunk_off = 0;
+			chunk_cur++;
+			chunk_fork();
+		}
+	}
+}
+
+// render and write frames, at most one period
+static uint16_t audio_period(uint16_t frames){
+	uint16_t done = 0;
+
+	// the backend may hand out its buffer in pieces, e.g. at the end of a ring
+	while(done < frames){
+		uint16_t n = frames - done;
+		float* buf = audio_output_begin(&n);
+		if(!buf){
+			break;
+		}
 
-			sample_ptr = samples;
+		if(ahead.buf){
+			ahead_read(buf, n);
+		} else if(chunks){
+			chunk_read(buf, n);
+		} else {
+			audio_render(buf, n);
+		}
+
+		// the volume goes on last, so a change is only behind what the device has queued
+		float volume;
+		__atomic_load(&cfg.volume, &volume, __ATOMIC_RELAXED);
+		if(out_gain != volume){
+			stats_heard(stats.delay * 1000.0 / out_freq);
 		}
+		dsp_gain(&out_gain, volume, 1000.0f / (RAMP_MS * out_freq), buf, n);
 
-		int n = MIN(end - p, sample_end - sample_ptr);
-		memcpy(p, sample_ptr, n * sizeof(float));
-		sample_ptr += n;
-		p += n;
+		audio_output_commit(buf, n);
+		done += n;
 	}
 
-out:
-	audio_output_write(buf, pcm_period_size);
+	out_frames += done;
+	stems_sync(out_frames);
 
-	if(paused) {
+	stats.periods++;
+	return done;
+}
+
+float audio_update(struct pollfd* fds, int nfds){
+	if(!audio_output_ready(fds, nfds)) {
 		return 0;
 	}
 
-	return (pcm_period_size * 1000.0f / FREQ);
+	uint16_t done = audio_period(pcm_period_size);
+
+	if(__atomic_load_n(&paused, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	return (done * 1000.0f / out_freq);
+}
+
+// for offline outputs: no polling, up to a period at a time, stopping at ms
+double audio_render_ms(double ms){
+	uint16_t frames = MIN((double)pcm_period_size, round(ms * out_freq / 1000.0));
+	return audio_period(frames) * 1000.0 / out_freq;
 }
 
 int audio_init(struct pollfd** fds, int nfds){
-	pcm_period_size = audio_output_init(fds, &nfds, FREQ);
+	out_freq = cfg.sample_rate;
+	pcm_period_size = audio_output_init(fds, &nfds, &out_freq);
+
+	if(out_freq != cfg.sample_rate){
+		debug_msg("Output rate %d unavailable, using %g", cfg.sample_rate, out_freq);
+	}
+
+	// synthesize at the output rate unless it's outside the range the
+	// integrator sounds right at, then let the resampler bridge the gap.
+	if(cfg.synth_rate){
+		synth_freq = cfg.synth_rate;
+	} else if(out_freq >= 44100.0f && out_freq <= 96000.0f){
+		synth_freq = out_freq;
+	} else {
+		synth_freq = 48000.0f;
+	}
+
+	// the high tier oversamples and lets the resampler band-limit the result.
+	// the post-mix filters run at the oversampled rate too.
+	if(cfg.quality == QUALITY_HIGH){
+		synth_freq *= HIGH_OVERSAMPLE;
+	}
+
+	if(synth_freq != out_freq){
+		resampler = resampler_new(synth_freq, out_freq);
+		debug_msg("Resampling %g -> %g", synth_freq, out_freq);
+	}
 
 	logbase = log(1.059463094f);
-	charge_factor = pow(0.999958, 4194304.0 / FREQ);
+	dsp = dsp_new(synth_freq);
+
+	out_gain = cfg.volume;
+	speed = cfg.speed;
+	ffwd  = cfg.ffwd;
+	out_frames = 0;
+	if(cfg.stems){
+		stems_begin(cfg.output_filename, synth_freq, out_freq);
+	}
+
+	if(!lfsr_tables[0].len){
+		lfsr_table_init(lfsr_tables + 0, 7);
+		lfsr_table_init(lfsr_tables + 1, 15);
+	}
+
+	// worst case frame: slowest timer rate at the lowest speed
+	nsamples_max = ((size_t)ceilf(synth_freq / (4096.0f / 256.0f * SPEED_MIN)) + 1) * 2;
+	samples      = calloc(nsamples_max, sizeof(float));
+	for(int i = 0; i < 4; ++i){
+		chan_samples[i] = calloc(nsamples_max, sizeof(float));
+	}
+
+	events_cap = 1024;
+	events     = malloc(events_cap * sizeof(*events));
 
 	audio_update_rate();
 
@@ -401,6 +1472,25 @@ int audio_init(struct pollfd** fds, int nfds){
 
 void audio_quit(void){
 	audio_output_quit();
+
+	if(resampler){
+		resampler_free(resampler);
+		resampler = NULL;
+	}
+
+	dsp_free(dsp);
+	stems_end();
+
+	free(samples);
+	for(int i = 0; i < 4; ++i){
+		free(chan_samples[i]);
+	}
+	free(events);
+
+	if(ahead.buf){
+		spsc_free(&ahead);
+		close(ahead_space_fd);
+	}
 }
 
 void audio_get_notes(uint16_t notes[static 4]){
@@ -432,6 +1522,17 @@ void audio_get_vol(uint8_t vol[static 8]){
 	if(vol[5]) vol[5] = 5*(4-vol[5]) * ch3_v;
 }
 
+// the rate the device actually opened at, which may not be cfg.sample_rate
+float audio_out_rate(void){
+	return out_freq;
+}
+
+void audio_speed(float s, int f){
+	speed = s;
+	ffwd  = f;
+	audio_update_rate();
+}
+
 void audio_update_rate(void){
 	audio_rate = 59.7f;
 
@@ -444,27 +1545,12 @@ void audio_update_rate(void){
 		if(tac & 0x80) audio_rate *= 2.0f;
 	}
 
-	audio_rate *= cfg.speed;
+	audio_rate *= speed;
 
 	debug_msg("Audio rate changed: %.4f", audio_rate);
 
-	size_t new_nsamples = (int)(FREQ / audio_rate) * 2;
-	float* new_samples = calloc(new_nsamples, sizeof(float));
-
-	if(samples){
-		memcpy(new_samples, samples, MIN(nsamples, new_nsamples));
-	}
-
-	free(samples);
-	samples    = new_samples;
-	nsamples   = new_nsamples;
-
-	free(samples_tmp);
-	samples_tmp = calloc(nsamples, sizeof(float));
-
-	// TODO: these should really be adjusted more accurately to not lose samples on speed change
-	sample_ptr = samples;
-	sample_end = samples + nsamples;
+	// takes effect from the next frame, whatever is left of this one still plays
+	frame_len = synth_freq / audio_rate;
 }
 
 void chan_trigger(int i){
@@ -478,26 +1564,29 @@ void chan_trigger(int i){
 	chan_enable(i, 1);
 	c->volume = c->volume_init;
 
+	// the frequency timer reloads
+	c->freq_counter = 0;
+
 	// volume envelope
 	{
-		uint8_t val = mem[0xFF12 + (i*5)];
+		uint8_t val = apu_regs[0x02 + (i*5)];
 
 		c->env.step    = val & 0x07;
 		c->env.up      = val & 0x08;
-		c->env.inc     = c->env.step ? (64.0f / (float)c->env.step) / FREQ : 8.0f / FREQ;
-		c->env.counter = 0.0f;
+		c->env.inc     = ctr_inc(c->env.step ? 64.0 / c->env.step : 8.0);
+		c->env.counter = 0;
 	}
 
 	// freq sweep
 	if(i == 0){
-		uint8_t val = mem[0xFF10];
+		uint8_t val = apu_regs[0x00];
 
 		c->sweep.freq    = c->freq;
 		c->sweep.rate    = (val >> 4) & 0x07;
 		c->sweep.up      = !(val & 0x08);
 		c->sweep.shift   = (val & 0x07);
-		c->sweep.inc     = c->sweep.rate ? (128.0f / (float)(c->sweep.rate)) / FREQ : 0;
-		c->sweep.counter = nexttowardf(1.0f, 1.1f);
+		c->sweep.inc     = c->sweep.rate ? ctr_inc(128.0 / c->sweep.rate) : 0;
+		c->sweep.counter = CTR_ONE; // steps on the first sample
 	}
 
 	if(i == 2){ // wave
@@ -511,14 +1600,17 @@ void chan_trigger(int i){
 void chan_update_len(int i) {
 	struct chan* c = chans + i;
 	int len_max = i == 2 ? 256 : 64;
-	c->len.inc = (256.0f / (float)(len_max - c->len.load)) / FREQ;
-	c->len.counter = 0.0f;
+	c->len.inc = ctr_inc(256.0 / (len_max - c->len.load));
+	c->len.counter = 0;
 }
 
-void audio_write(uint16_t addr, uint8_t val){
+void audio_write(uint16_t addr, uint8_t val, uint32_t cycle){
+	if(addr == 0xFF26){
+		audio_sync();
+	}
 
 	if(!cfg.subdued && mem[addr] != val){
-		ui_regs_set(addr, audio_rate / 8);
+		viz_written[addr - 0xFF10] = MIN(255.0f, audio_rate / 8);
 	}
 
 	int i = (addr - 0xFF10)/5;
@@ -532,6 +1624,19 @@ void audio_write(uint16_t addr, uint8_t val){
 		}
 	}
 
+	mem[addr] = val;
+
+	if(nevents == events_cap){
+		events_cap *= 2;
+		events = realloc(events, events_cap * sizeof(*events));
+	}
+
+	events[nevents++] = (struct apu_event){ .cycle = cycle, .addr = addr, .val = val };
+}
+
+static void audio_apply(uint16_t addr, uint8_t val){
+	int i = (addr - 0xFF10)/5;
+
 	switch(addr){
 
 		case 0xFF12:
@@ -563,6 +1668,11 @@ void audio_write(uint16_t addr, uint8_t val){
 
 		case 0xFF1C:
 			chans[i].volume = chans[i].volume_init = (val >> 5) & 0x03;
+			wave_decode_all();
+			break;
+
+		case 0xFF30 ... 0xFF3F:
+			wave_decode(addr - 0xFF30, val);
 			break;
 
 		case 0xFF11:
@@ -621,5 +1731,5 @@ void audio_write(uint16_t addr, uint8_t val){
 		} break;
 	}
 
-	mem[addr] = val;
+	apu_regs[addr - 0xFF10] = val;
 }
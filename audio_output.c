@@ -1,21 +1,342 @@
 #include "minigbs.h"
+#include <sys/stat.h>
+#include <strings.h>
+#include <poll.h>
+#include <pthread.h>
+#include <inttypes.h>
 
 struct audio_output* audio_output;
 
-uint16_t audio_output_init(struct pollfd** fds, int* nfds, float freq) {
-	return audio_output->init(audio_output, fds, nfds, freq);
+#define MAX_TAPS 8
+
+// copies of backends, NULL where free. the slots are swapped atomically so
+// the UI thread can tap and untap while the writer runs, and each time the
+// writer is between periods it bumps tap_epoch, so an untapped sink can be
+// closed once the writer is known to be done with it.
+static struct audio_output* taps[MAX_TAPS];
+static uint64_t tap_epoch;
+static float    tap_freq;
+static uint16_t tap_period;
+static void*    tap_buf; // a period in the widest format, taps take turns
+
+// the taps are written on a thread of their own, so a FLAC batch or a fresh
+// WAV window can't make the device miss a period. the audio thread only
+// copies each period into tap_queue. when that's full during playback, the
+// period is dropped from the taps; offline, the renderer waits for room.
+#define TAP_QUEUE_MS 1000
+
+struct tap_slot {
+	uint16_t frames;
+	float    samples[]; // tap_period frames
+};
+
+static struct spsc tap_queue;
+static int         tap_data_fd;  // a period was queued
+static int         tap_space_fd; // a period was written
+static pthread_t   tap_tid;
+static bool        tap_running;
+static bool        tap_quit;
+static uint64_t    tap_dropped;
+
+static float* float_buf;
+static bool   float_mapped; // float_buf handed out is the backend's own memory
+
+// samples in cfg.format, when that isn't float and the backend can't be
+// written in place
+static void* convert_buf;
+
+uint16_t audio_output_init(struct pollfd** fds, int* nfds, float* freq) {
+	audio_output->format = cfg.format;
+
+	uint16_t period_size = audio_output->init(audio_output, fds, nfds, freq);
+	if(!period_size) {
+		exit(1);
+	}
+
+	// the backend may have picked another format, e.g. what the device takes
+	cfg.format = audio_output->format;
+	tap_freq   = *freq;
+	tap_period = period_size;
+	tap_buf    = malloc(period_size * 2 * sizeof(float));
+
+	float_buf = malloc(period_size * 2 * sizeof(float));
+
+	if(cfg.format != FMT_F32 && !audio_output->begin) {
+		convert_buf = malloc(period_size * 2 * format_bytes(cfg.format));
+	}
+
+	return period_size;
 }
 
 void audio_output_quit(void) {
+	audio_output_taps_stop();
+
+	for(int i = 0; i < MAX_TAPS; ++i) {
+		if(taps[i]) {
+			audio_output_close(taps[i]);
+			taps[i] = NULL;
+		}
+	}
+
 	audio_output->quit(audio_output);
+
+	free(float_buf);
+	free(convert_buf);
+	float_buf = convert_buf = NULL;
+	free(tap_buf);
+	tap_buf = NULL;
+	tap_period = 0;
 }
 
 bool audio_output_ready(struct pollfd* fds, int nfds) {
 	return audio_output->ready(audio_output, fds, nfds);
 }
 
-void audio_output_write(const float* samples, uint16_t period_size) {
-	audio_output->write(audio_output, samples, period_size);
+// where to render the next *frames frames, which may be fewer than asked for
+float* audio_output_begin(uint16_t* frames) {
+	float_mapped = audio_output->begin && cfg.format == FMT_F32;
+
+	if(float_mapped) {
+		return audio_output->begin(audio_output, frames);
+	}
+
+	return float_buf;
+}
+
+static void taps_write(const float* samples, uint16_t frames) {
+	for(int i = 0; i < MAX_TAPS; ++i) {
+		struct audio_output* out = __atomic_load_n(&taps[i], __ATOMIC_SEQ_CST);
+
+		if(!out) {
+			continue;
+		} else if(out->format == FMT_F32) {
+			out->write(out, samples, frames);
+		} else {
+			convert_samples(tap_buf, samples, frames * 2, out->format, cfg.dither);
+			out->write(out, tap_buf, frames);
+		}
+	}
+}
+
+static void* tap_thread(void* arg) {
+	eventfd_t n;
+
+	while(1) {
+		for(struct tap_slot* s; (s = spsc_peek(&tap_queue)); spsc_pop(&tap_queue)) {
+			taps_write(s->samples, s->frames);
+			eventfd_write(tap_space_fd, 1);
+		}
+
+		// holding no sink here. the timeout keeps this going while nothing's
+		// tapped, so the last sink untapped still gets released.
+		__atomic_add_fetch(&tap_epoch, 1, __ATOMIC_SEQ_CST);
+
+		if(__atomic_load_n(&tap_quit, __ATOMIC_ACQUIRE) && !spsc_peek(&tap_queue)) {
+			break;
+		}
+
+		struct pollfd p = { tap_data_fd, POLLIN };
+		if(poll(&p, 1, 100) > 0) {
+			eventfd_read(tap_data_fd, &n);
+		}
+	}
+
+	return NULL;
+}
+
+static bool taps_start(void) {
+	if(tap_running) {
+		return true;
+	}
+
+	size_t count = MAX((size_t)2, (size_t)(tap_freq * TAP_QUEUE_MS / 1000.0f / tap_period));
+	spsc_init(&tap_queue, sizeof(struct tap_slot) + tap_period * 2 * sizeof(float), count);
+	tap_data_fd  = eventfd(0, 0);
+	tap_space_fd = eventfd(0, 0);
+	tap_quit     = false;
+	tap_dropped  = 0;
+
+	int err = pthread_create(&tap_tid, NULL, tap_thread, NULL);
+	if(err) {
+		debug_msg("pthread_create: %s", strerror(err));
+		spsc_free(&tap_queue);
+		close(tap_data_fd);
+		close(tap_space_fd);
+		return false;
+	}
+
+	__atomic_store_n(&tap_running, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+// write out whatever's queued and stop the writer, the audio side has to be
+// done committing
+void audio_output_taps_stop(void) {
+	if(!tap_running) {
+		return;
+	}
+
+	__atomic_store_n(&tap_quit, true, __ATOMIC_RELEASE);
+	eventfd_write(tap_data_fd, 1);
+	pthread_join(tap_tid, NULL);
+
+	if(tap_dropped) {
+		debug_msg("Taps fell behind, %" PRIu64 " periods dropped", tap_dropped);
+	}
+
+	spsc_free(&tap_queue);
+	close(tap_data_fd);
+	close(tap_space_fd);
+	tap_running = false;
+}
+
+// audio side: hand the period to the writer, if anything is tapped
+static void taps_queue(const float* samples, uint16_t frames) {
+	if(!__atomic_load_n(&tap_running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	bool any = false;
+	for(int i = 0; i < MAX_TAPS; ++i) {
+		any |= __atomic_load_n(&taps[i], __ATOMIC_RELAXED) != NULL;
+	}
+	if(!any) {
+		return;
+	}
+
+	struct tap_slot* s;
+	eventfd_t n;
+
+	while(!(s = spsc_slot(&tap_queue))) {
+		if(audio_output->interactive) {
+			tap_dropped++;
+			return;
+		}
+		eventfd_read(tap_space_fd, &n);
+	}
+
+	s->frames = frames;
+	memcpy(s->samples, samples, frames * 2 * sizeof(float));
+	spsc_push(&tap_queue);
+	eventfd_write(tap_data_fd, 1);
+}
+
+void audio_output_commit(float* samples, uint16_t frames) {
+	// before the backend gets it, samples may be its ring buffer
+	taps_queue(samples, frames);
+
+	if(float_mapped) {
+		audio_output->commit(audio_output, frames);
+		return;
+	}
+
+	// convert straight into the backend's memory
+	if(audio_output->begin) {
+		while(frames) {
+			uint16_t n = frames;
+			void* dst = audio_output->begin(audio_output, &n);
+			if(!dst) {
+				break;
+			}
+
+			convert_samples(dst, samples, n * 2, cfg.format, cfg.dither);
+			audio_output->commit(audio_output, n);
+
+			samples += n * 2;
+			frames -= n;
+		}
+		return;
+	}
+
+	if(convert_buf) {
+		convert_samples(convert_buf, samples, frames * 2, cfg.format, cfg.dither);
+		audio_output->write(audio_output, convert_buf, frames);
+	} else {
+		audio_output->write(audio_output, samples, frames);
+	}
+}
+
+// the backend a file name asks for: a stream for "-" and FIFOs, FLAC by
+// extension, WAV otherwise
+struct audio_output* audio_output_for(const char* filename) {
+	struct stat st;
+
+	if(strcmp(filename, "-") == 0 || (stat(filename, &st) == 0 && S_ISFIFO(st.st_mode))) {
+		return output_pipe;
+	}
+
+	const char* ext = strrchr(filename, '.');
+	if(ext && strcasecmp(ext, ".flac") == 0) {
+		return output_flac;
+	}
+
+	return output_wav;
+}
+
+struct audio_output* audio_output_open(struct audio_output* backend, const char* filename, enum SampleFormat fmt) {
+	// no devices, so one can't stall the other. streams opened here don't
+	// block either while a device is playing, see pipe_init.
+	if(backend->interactive || !tap_period) {
+		return NULL;
+	}
+
+	struct audio_output* out = malloc(backend->size);
+	memcpy(out, backend, backend->size);
+	out->filename = strdup(filename);
+	out->format = fmt;
+
+	// file sinks don't poll, and take whatever rate they're given
+	struct pollfd* fds = NULL;
+	int nfds = 0;
+	float freq = tap_freq;
+
+	uint16_t period_size = out->init(out, &fds, &nfds, &freq);
+	free(fds);
+
+	if(!period_size) {
+		free((char*)out->filename);
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+bool audio_output_tap(struct audio_output* out) {
+	if(!taps_start()) {
+		return false;
+	}
+
+	for(int i = 0; i < MAX_TAPS; ++i) {
+		struct audio_output* none = NULL;
+		if(__atomic_compare_exchange_n(&taps[i], &none, out, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// returns a ticket for audio_output_released
+uint64_t audio_output_untap(struct audio_output* out) {
+	for(int i = 0; i < MAX_TAPS; ++i) {
+		if(taps[i] == out) {
+			__atomic_store_n(&taps[i], NULL, __ATOMIC_SEQ_CST);
+		}
+	}
+
+	return __atomic_load_n(&tap_epoch, __ATOMIC_SEQ_CST) + 1;
+}
+
+// whether the sink untapped with this ticket can't be written to any more
+bool audio_output_released(uint64_t ticket) {
+	return __atomic_load_n(&tap_epoch, __ATOMIC_SEQ_CST) >= ticket;
+}
+
+void audio_output_close(struct audio_output* out) {
+	out->quit(out);
+	free((char*)out->filename);
+	free(out);
 }
 
 /////// ALSA OUTPUT
@@ -26,14 +347,105 @@ struct audio_alsa {
 	snd_pcm_t* pcm;
 	snd_pcm_uframes_t pcm_buffer_size;
 	snd_pcm_uframes_t pcm_period_size;
+	snd_pcm_uframes_t mmap_offset;
+};
+
+#define ALSA_CHECK(x) do { \
+	int err = (x); \
+	if(err < 0) { \
+		fprintf(stderr, "ALSA: %s: %s\n", #x, snd_strerror(err)); \
+		exit(1); \
+	} \
+} while(0)
+
+static void* alsa_begin(struct audio_output* out, uint16_t* frames);
+static void  alsa_commit(struct audio_output* out, uint16_t frames);
+
+static const snd_pcm_format_t alsa_formats[FMT_COUNT] = {
+	[FMT_F32] = SND_PCM_FORMAT_FLOAT,
+	[FMT_S32] = SND_PCM_FORMAT_S32,
+	[FMT_S24] = SND_PCM_FORMAT_S24_3LE,
+	[FMT_S16] = SND_PCM_FORMAT_S16,
 };
 
-static uint16_t alsa_init(struct audio_output* out, struct pollfd** fds, int* nfds, float freq) {
+// formats worth trying when none was asked for, best first. the device is
+// opened with SND_PCM_NO_AUTO_FORMAT for this, so plug devices only offer
+// what's underneath instead of accepting anything and converting it.
+static const enum SampleFormat alsa_format_order[] = { FMT_S32, FMT_S16, FMT_S24, FMT_F32 };
+
+static void alsa_open(struct audio_alsa* alsa, const char* device, int mode, snd_pcm_hw_params_t* hw) {
+	ALSA_CHECK(snd_pcm_open(&alsa->pcm, device, SND_PCM_STREAM_PLAYBACK, mode));
+	ALSA_CHECK(snd_pcm_hw_params_any(alsa->pcm, hw));
+
+	snd_pcm_access_t access = cfg.alsa_mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED;
+	ALSA_CHECK(snd_pcm_hw_params_set_access(alsa->pcm, hw, access));
+}
+
+static uint16_t alsa_init(struct audio_output* out, struct pollfd** fds, int* nfds, float* freq) {
 	struct audio_alsa* alsa = (struct audio_alsa*)out;
 
-	snd_pcm_open(&alsa->pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
-	snd_pcm_set_params(alsa->pcm, SND_PCM_FORMAT_FLOAT, SND_PCM_ACCESS_RW_INTERLEAVED, 2, freq, 1, 16667);
-	snd_pcm_get_params(alsa->pcm, &alsa->pcm_buffer_size, &alsa->pcm_period_size);
+	const char* device = cfg.alsa_device ? cfg.alsa_device : "default";
+
+	snd_pcm_hw_params_t* hw;
+	snd_pcm_hw_params_alloca(&hw);
+	alsa_open(alsa, device, cfg.format_auto ? SND_PCM_NO_AUTO_FORMAT : 0, hw);
+
+	if(cfg.format_auto) {
+		out->format = FMT_COUNT;
+		for(size_t i = 0; i < countof(alsa_format_order); ++i) {
+			if(snd_pcm_hw_params_test_format(alsa->pcm, hw, alsa_formats[alsa_format_order[i]]) == 0) {
+				out->format = alsa_format_order[i];
+				break;
+			}
+		}
+
+		// nothing we write natively, let libasound convert from float
+		if(out->format == FMT_COUNT) {
+			snd_pcm_close(alsa->pcm);
+			alsa_open(alsa, device, 0, hw);
+			out->format = FMT_F32;
+		}
+	}
+
+	ALSA_CHECK(snd_pcm_hw_params_set_format(alsa->pcm, hw, alsa_formats[out->format]));
+	ALSA_CHECK(snd_pcm_hw_params_set_channels(alsa->pcm, hw, 2));
+
+	// resampling is ours to do, take the nearest rate the device runs at
+	ALSA_CHECK(snd_pcm_hw_params_set_rate_resample(alsa->pcm, hw, 0));
+
+	unsigned rate = *freq;
+	ALSA_CHECK(snd_pcm_hw_params_set_rate_near(alsa->pcm, hw, &rate, NULL));
+	*freq = rate;
+
+	debug_msg("ALSA: %s, %s at %uHz", device, snd_pcm_format_name(alsa_formats[out->format]), rate);
+
+	unsigned buffer_us = cfg.alsa_buffer_us ? cfg.alsa_buffer_us : 16667;
+	ALSA_CHECK(snd_pcm_hw_params_set_buffer_time_near(alsa->pcm, hw, &buffer_us, NULL));
+
+	if(cfg.alsa_period) {
+		snd_pcm_uframes_t period = cfg.alsa_period;
+		ALSA_CHECK(snd_pcm_hw_params_set_period_size_near(alsa->pcm, hw, &period, NULL));
+	} else {
+		unsigned period_us = buffer_us / 4;
+		ALSA_CHECK(snd_pcm_hw_params_set_period_time_near(alsa->pcm, hw, &period_us, NULL));
+	}
+
+	ALSA_CHECK(snd_pcm_hw_params(alsa->pcm, hw));
+	snd_pcm_hw_params_get_buffer_size(hw, &alsa->pcm_buffer_size);
+	snd_pcm_hw_params_get_period_size(hw, &alsa->pcm_period_size, NULL);
+
+	// same thresholds snd_pcm_set_params would have picked
+	snd_pcm_sw_params_t* sw;
+	snd_pcm_sw_params_alloca(&sw);
+	ALSA_CHECK(snd_pcm_sw_params_current(alsa->pcm, sw));
+	ALSA_CHECK(snd_pcm_sw_params_set_start_threshold(alsa->pcm, sw, (alsa->pcm_buffer_size / alsa->pcm_period_size) * alsa->pcm_period_size));
+	ALSA_CHECK(snd_pcm_sw_params_set_avail_min(alsa->pcm, sw, alsa->pcm_period_size));
+	ALSA_CHECK(snd_pcm_sw_params(alsa->pcm, sw));
+
+	if(cfg.alsa_mmap) {
+		alsa->output.begin  = alsa_begin;
+		alsa->output.commit = alsa_commit;
+	}
 
 	int count = snd_pcm_poll_descriptors_count(alsa->pcm);
 	*fds = realloc(*fds, (*nfds + count) * sizeof(struct pollfd));
@@ -41,7 +453,22 @@ static uint16_t alsa_init(struct audio_output* out, struct pollfd** fds, int* nf
 
 	*nfds += count;
 
-	return alsa->pcm_period_size;
+	return MIN(alsa->pcm_period_size, (snd_pcm_uframes_t)UINT16_MAX);
+}
+
+static void alsa_recover(struct audio_alsa* alsa, int err) {
+	if(err == -EPIPE || err == -ESTRPIPE) {
+		stats.xruns++;
+	}
+	snd_pcm_recover(alsa->pcm, err, 1);
+}
+
+static void alsa_delay(struct audio_alsa* alsa) {
+	snd_pcm_sframes_t delay;
+	if(snd_pcm_delay(alsa->pcm, &delay) == 0) {
+		stats.delay = delay;
+		stats.delay_max = MAX(stats.delay_max, (long)delay);
+	}
 }
 
 static void alsa_quit(struct audio_output* out) {
@@ -59,17 +486,94 @@ static bool alsa_ready(struct audio_output* out, struct pollfd* fds, int nfds) {
 	return (ev & POLLOUT);
 }
 
-static void alsa_write(struct audio_output* out, const float* samples, uint16_t period_size) {
+static void alsa_write(struct audio_output* out, const void* samples, uint16_t period_size) {
 	struct audio_alsa* alsa = (struct audio_alsa*)out;
 
 	int err = snd_pcm_writei(alsa->pcm, samples, period_size);
 	if(err < 0){
-		snd_pcm_recover(alsa->pcm, err, 1);
+		alsa_recover(alsa, err);
+	}
+
+	alsa_delay(alsa);
+}
+
+// mmap access: hand out the ring buffer itself, so audio_update renders
+// (or converts) straight into it instead of going through snd_pcm_writei.
+static void* alsa_begin(struct audio_output* out, uint16_t* frames) {
+	struct audio_alsa* alsa = (struct audio_alsa*)out;
+
+	for(int tries = 0; tries < 2; ++tries) {
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(alsa->pcm);
+		if(avail < 0) {
+			alsa_recover(alsa, avail);
+			continue;
+		}
+
+		const snd_pcm_channel_area_t* areas;
+		snd_pcm_uframes_t n = *frames;
+
+		int err = snd_pcm_mmap_begin(alsa->pcm, &areas, &alsa->mmap_offset, &n);
+		if(err < 0) {
+			alsa_recover(alsa, err);
+			continue;
+		}
+
+		if(n == 0) {
+			return NULL;
+		}
+
+		*frames = n;
+		return (uint8_t*)areas[0].addr + areas[0].first / 8 + alsa->mmap_offset * (areas[0].step / 8);
+	}
+
+	return NULL;
+}
+
+static void alsa_commit(struct audio_output* out, uint16_t frames) {
+	struct audio_alsa* alsa = (struct audio_alsa*)out;
+
+	snd_pcm_uframes_t offset = alsa->mmap_offset;
+	snd_pcm_uframes_t n = frames;
+
+	// a short commit isn't an underrun: the rest is still in the buffer right
+	// after what went through, so hand it over in another begin/commit round
+	while(1) {
+		snd_pcm_sframes_t done = snd_pcm_mmap_commit(alsa->pcm, offset, n);
+		if(done < 0) {
+			alsa_recover(alsa, done);
+			return;
+		}
+
+		frames -= done;
+		if(!frames || !done) {
+			break;
+		}
+
+		const snd_pcm_channel_area_t* areas;
+		n = frames;
+
+		int err = snd_pcm_mmap_begin(alsa->pcm, &areas, &offset, &n);
+		if(err < 0) {
+			alsa_recover(alsa, err);
+			return;
+		}
+
+		if(n == 0) {
+			break;
+		}
+	}
+
+	alsa_delay(alsa);
+
+	// unlike writei, committing doesn't start the stream by itself
+	if(snd_pcm_state(alsa->pcm) == SND_PCM_STATE_PREPARED && snd_pcm_avail_update(alsa->pcm) < (snd_pcm_sframes_t)alsa->pcm_period_size) {
+		snd_pcm_start(alsa->pcm);
 	}
 }
 
 static struct audio_alsa _output_alsa = {
 	.output = {
+		.size = sizeof(struct audio_alsa),
 		.interactive = true,
 		.init  = alsa_init,
 		.quit  = alsa_quit,
@@ -83,34 +587,25 @@ struct audio_output* output_alsa = &_output_alsa.output;
 /////// WAV OUTPUT
 
 struct wav_writer;
-struct wav_writer* wav_write_begin(const char* filename, uint32_t freq);
-void wav_write_push (struct wav_writer* wav, const float* samples, uint16_t period_size);
+struct wav_writer* wav_write_begin(const char* filename, uint32_t freq, enum SampleFormat fmt);
+void wav_write_push (struct wav_writer* wav, const void* samples, uint16_t period_size);
 void wav_write_end  (struct wav_writer* wav);
 
 struct audio_wav {
 	struct audio_output output;
 	struct wav_writer* writer;
-	int eventfd;
 };
 
-static uint16_t wav_init(struct audio_output* out, struct pollfd** fds, int* nfds, float freq) {
+static uint16_t wav_init(struct audio_output* out, struct pollfd** fds, int* nfds, float* freq) {
 	struct audio_wav* wav = (struct audio_wav*)out;
-	wav->writer = wav_write_begin(wav->output.filename, freq);
+	wav->writer = wav_write_begin(wav->output.filename, *freq, out->format);
 	if(!wav->writer) {
 		fprintf(stderr, "Error opening .wav file\n");
-		exit(1);
+		return 0;
 	}
 
-	wav->eventfd = eventfd(1, 0);
-
-	*fds = realloc(*fds, (*nfds + 1) * sizeof(struct pollfd));
-	(*fds)[*nfds] = (struct pollfd){
-		.fd = wav->eventfd,
-		.events = POLLIN,
-	};
-	*nfds += 1;
-
-	return freq / 60;
+	// rendered offline in a tight loop, so big blocks cost nothing in latency
+	return 8192;
 }
 
 static void wav_quit(struct audio_output* out) {
@@ -122,13 +617,14 @@ static bool wav_ready(struct audio_output* out, struct pollfd* fds, int nfds) {
 	return true;
 }
 
-static void wav_write(struct audio_output* out, const float* samples, uint16_t period_size) {
+static void wav_write(struct audio_output* out, const void* samples, uint16_t period_size) {
 	struct audio_wav* wav = (struct audio_wav*)out;
 	wav_write_push(wav->writer, samples, period_size);
 }
 
 static struct audio_wav _output_wav = {
 	.output = {
+		.size = sizeof(struct audio_wav),
 		.interactive = false,
 		.init  = wav_init,
 		.quit  = wav_quit,
@@ -138,3 +634,208 @@ static struct audio_wav _output_wav = {
 };
 
 struct audio_output* output_wav = &_output_wav.output;
+
+/////// FLAC OUTPUT
+
+struct flac_writer;
+struct flac_writer* flac_write_begin(const char* filename, uint32_t freq, enum SampleFormat fmt);
+void flac_write_push (struct flac_writer* flac, const void* samples, uint16_t period_size);
+void flac_write_end  (struct flac_writer* flac);
+
+struct audio_flac {
+	struct audio_output output;
+	struct flac_writer* writer;
+};
+
+static uint16_t flac_init(struct audio_output* out, struct pollfd** fds, int* nfds, float* freq) {
+	struct audio_flac* flac = (struct audio_flac*)out;
+	// FLAC is integer only, and the DMG's 4-bit DACs don't need more than 16
+	if(out->format != FMT_S16 && out->format != FMT_S24) {
+		out->format = FMT_S16;
+	}
+
+	flac->writer = flac_write_begin(flac->output.filename, *freq, out->format);
+	if(!flac->writer) {
+		fprintf(stderr, "Error opening .flac file\n");
+		return 0;
+	}
+
+	return 8192;
+}
+
+static void flac_quit(struct audio_output* out) {
+	struct audio_flac* flac = (struct audio_flac*)out;
+	flac_write_end(flac->writer);
+}
+
+static bool flac_ready(struct audio_output* out, struct pollfd* fds, int nfds) {
+	return true;
+}
+
+static void flac_write(struct audio_output* out, const void* samples, uint16_t period_size) {
+	struct audio_flac* flac = (struct audio_flac*)out;
+	flac_write_push(flac->writer, samples, period_size);
+}
+
+static struct audio_flac _output_flac = {
+	.output = {
+		.size = sizeof(struct audio_flac),
+		.interactive = false,
+		.init  = flac_init,
+		.quit  = flac_quit,
+		.ready = flac_ready,
+		.write = flac_write,
+	}
+};
+
+struct audio_output* output_flac = &_output_flac.output;
+
+/////// PIPE OUTPUT
+#include <fcntl.h>
+#include <signal.h>
+
+size_t wav_stream_header(void* out, uint32_t freq, enum SampleFormat fmt);
+
+// raw or streaming-WAV PCM to stdout ("-") or a FIFO, for feeding encoders.
+// writes are batched into PIPE_BUF_SIZE chunks and block when the reader
+// falls behind, which is all the backpressure offline rendering needs.
+// a tap next to a device can't wait like that without making it xrun, so
+// it writes what the reader takes and drops whole periods past a full buffer.
+
+#define PIPE_BUF_SIZE (1 << 20)
+
+struct audio_pipe {
+	struct audio_output output;
+	int fd;
+	uint8_t* buf;
+	size_t fill;
+	bool broken;   // reader went away
+	bool raw;      // -R, for the -w output only
+	bool nonblock; // tapped while a device plays
+};
+
+static void pipe_flush(struct audio_pipe* p) {
+	size_t off = 0;
+
+	while(off < p->fill && !p->broken) {
+		ssize_t n = write(p->fd, p->buf + off, p->fill - off);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) break;
+			if(errno != EPIPE) perror("write");
+			p->broken = true;
+		} else {
+			off += n;
+		}
+	}
+
+	// a non-blocking write may stop partway, keep the rest for next time
+	p->fill -= MIN(off, p->fill);
+	memmove(p->buf, p->buf + off, p->fill);
+}
+
+static uint16_t pipe_init(struct audio_output* out, struct pollfd** fds, int* nfds, float* freq) {
+	struct audio_pipe* p = (struct audio_pipe*)out;
+
+	p->raw = cfg.raw && out == output_pipe;
+	p->nonblock = out != output_pipe && audio_output->interactive;
+
+	// non-blocking, a FIFO without a reader fails to open instead of waiting
+	int flags = p->nonblock ? O_NONBLOCK : 0;
+
+	if(strcmp(p->output.filename, "-") == 0) {
+		p->fd = STDOUT_FILENO;
+		if(flags) fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) | flags);
+	} else {
+		// an old file would leave its tail past the new end. FIFOs ignore O_TRUNC.
+		p->fd = open(p->output.filename, O_WRONLY | O_CREAT | O_TRUNC | flags, 0644);
+	}
+
+	if(p->fd == -1) {
+		fprintf(stderr, "open(%s): %m\n", p->output.filename);
+		return 0;
+	}
+
+	// a closed reader should end the render, not kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	// bigger pipe, fewer wakeups on both ends. not fatal if refused.
+	fcntl(p->fd, F_SETPIPE_SZ, PIPE_BUF_SIZE);
+
+	p->buf = malloc(PIPE_BUF_SIZE);
+	p->fill = p->raw ? 0 : wav_stream_header(p->buf, *freq, out->format);
+
+	return 8192;
+}
+
+static void pipe_quit(struct audio_output* out) {
+	struct audio_pipe* p = (struct audio_pipe*)out;
+
+	pipe_flush(p);
+	if(p->fd != STDOUT_FILENO) {
+		close(p->fd);
+	}
+	free(p->buf);
+}
+
+static bool pipe_ready(struct audio_output* out, struct pollfd* fds, int nfds) {
+	struct audio_pipe* p = (struct audio_pipe*)out;
+	return !p->broken;
+}
+
+static void pipe_write(struct audio_output* out, const void* samples, uint16_t period_size) {
+	struct audio_pipe* p = (struct audio_pipe*)out;
+	size_t size = period_size * 2 * format_bytes(out->format);
+
+	if(p->nonblock || p->fill + size > PIPE_BUF_SIZE) {
+		pipe_flush(p);
+	}
+
+	// only when non-blocking, a blocking flush always empties it
+	if(p->fill + size > PIPE_BUF_SIZE) {
+		return;
+	}
+
+	memcpy(p->buf + p->fill, samples, size);
+	p->fill += size;
+}
+
+static struct audio_pipe _output_pipe = {
+	.output = {
+		.size = sizeof(struct audio_pipe),
+		.interactive = false,
+		.init  = pipe_init,
+		.quit  = pipe_quit,
+		.ready = pipe_ready,
+		.write = pipe_write,
+	}
+};
+
+struct audio_output* output_pipe = &_output_pipe.output;
+
+/////// NULL OUTPUT
+
+static uint16_t null_init(struct audio_output* out, struct pollfd** fds, int* nfds, float* freq) {
+	return *freq / 60;
+}
+
+static void null_quit(struct audio_output* out) {
+}
+
+static bool null_ready(struct audio_output* out, struct pollfd* fds, int nfds) {
+	return true;
+}
+
+static void null_write(struct audio_output* out, const void* samples, uint16_t period_size) {
+}
+
+static struct audio_output _output_null = {
+	.size = sizeof(struct audio_output),
+	.interactive = false,
+	.init  = null_init,
+	.quit  = null_quit,
+	.ready = null_ready,
+	.write = null_write,
+};
+
+struct audio_output* output_null = &_output_null;
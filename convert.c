@@ -0,0 +1,218 @@
+#include "minigbs.h"
+#include <math.h>
+
+// Float to integer PCM for the output backends. TPDF dither is the difference
+// of two uniform draws of one LSB each, from per-lane xorshift32 generators.
+// S24 is packed little-endian 3 byte samples, as both WAV and ALSA's
+// S24_3LE expect. S32 is never dithered, floats don't have the bits for it.
+//
+// Without dither every path gives the same output. With it, the SIMD paths
+// draw from more generators than the scalar one, so the noise is the same
+// kind but not the same values.
+
+#define LANES 16 // two generators for each of AVX2's 8 lanes
+
+static uint32_t seed[LANES] = {
+	0x9E3779B9, 0x7F4A7C15, 0x85EBCA6B, 0xC2B2AE35,
+	0x27D4EB2F, 0x165667B1, 0xD3A2646C, 0xFD7046C5,
+	0xB55A4F09, 0x94D049BB, 0xBF58476D, 0x2545F491,
+	0x68E31DA4, 0xB5297A4D, 0x1B56C4E9, 0x8CB92BA7,
+};
+
+size_t format_bytes(enum SampleFormat fmt){
+	return (size_t[]){ 4, 2, 3, 4 }[fmt];
+}
+
+static float format_scale(enum SampleFormat fmt){
+	return (float[]){ 1.0f, 32768.0f, 8388608.0f, 2147483648.0f }[fmt];
+}
+
+// the largest float that still converts into range
+static float format_max(enum SampleFormat fmt){
+	return (float[]){ 1.0f, 32767.0f, 8388607.0f, 2147483520.0f }[fmt];
+}
+
+static inline uint32_t xorshift32(uint32_t* s){
+	uint32_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *s = x;
+}
+
+// [0, 1) from the top 23 bits
+static inline float uniform(uint32_t x){
+	union { uint32_t u; float f; } v = { (x >> 9) | 0x3F800000 };
+	return v.f - 1.0f;
+}
+
+static inline void store(void* dst, size_t i, int32_t v, enum SampleFormat fmt){
+	switch(fmt){
+		case FMT_S16:
+			((int16_t*)dst)[i] = v;
+			break;
+		case FMT_S24: {
+			uint8_t* p = (uint8_t*)dst + i * 3;
+			p[0] = v;
+			p[1] = v >> 8;
+			p[2] = v >> 16;
+		} break;
+		default:
+			((int32_t*)dst)[i] = v;
+			break;
+	}
+}
+
+static void convert_scalar(void* dst, const float* src, size_t from, size_t n, enum SampleFormat fmt, bool dither){
+	const float scale = format_scale(fmt);
+	const float max = format_max(fmt);
+	const float min = -scale;
+
+	for(size_t i = from; i < n; ++i){
+		float x = src[i] * scale;
+
+		if(dither){
+			x += uniform(xorshift32(seed + 0)) - uniform(xorshift32(seed + 1));
+		}
+
+		x = x > max ? max : x < min ? min : x;
+		store(dst, i, lrintf(x), fmt);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static __m128 uniform_sse2(__m128i* s){
+	__m128i x = *s;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	*s = x;
+
+	__m128i m = _mm_or_si128(_mm_srli_epi32(x, 9), _mm_set1_epi32(0x3F800000));
+	return _mm_sub_ps(_mm_castsi128_ps(m), _mm_set1_ps(1.0f));
+}
+
+__attribute__((target("sse2")))
+static size_t convert_sse2(void* dst, const float* src, size_t n, enum SampleFormat fmt, bool dither){
+	const __m128 scale = _mm_set1_ps(format_scale(fmt));
+	const __m128 max = _mm_set1_ps(format_max(fmt));
+	const __m128 min = _mm_set1_ps(-format_scale(fmt));
+
+	__m128i s0 = _mm_loadu_si128((__m128i*)seed);
+	__m128i s1 = _mm_loadu_si128((__m128i*)(seed + 4));
+	size_t i = 0;
+
+	for(; i + 8 <= n; i += 8){
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i + 0), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+
+		if(dither){
+			a = _mm_add_ps(a, _mm_sub_ps(uniform_sse2(&s0), uniform_sse2(&s1)));
+			b = _mm_add_ps(b, _mm_sub_ps(uniform_sse2(&s0), uniform_sse2(&s1)));
+		}
+
+		__m128i ia = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(a, max), min));
+		__m128i ib = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(b, max), min));
+
+		if(fmt == FMT_S16){
+			_mm_storeu_si128((__m128i*)((int16_t*)dst + i), _mm_packs_epi32(ia, ib));
+		} else if(fmt == FMT_S32){
+			_mm_storeu_si128((__m128i*)((int32_t*)dst + i + 0), ia);
+			_mm_storeu_si128((__m128i*)((int32_t*)dst + i + 4), ib);
+		} else {
+			int32_t tmp[8];
+			_mm_storeu_si128((__m128i*)(tmp + 0), ia);
+			_mm_storeu_si128((__m128i*)(tmp + 4), ib);
+			for(int j = 0; j < 8; ++j) store(dst, i + j, tmp[j], fmt);
+		}
+	}
+
+	_mm_storeu_si128((__m128i*)seed, s0);
+	_mm_storeu_si128((__m128i*)(seed + 4), s1);
+	return i;
+}
+
+__attribute__((target("avx2")))
+static __m256 uniform_avx2(__m256i* s){
+	__m256i x = *s;
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	*s = x;
+
+	__m256i m = _mm256_or_si256(_mm256_srli_epi32(x, 9), _mm256_set1_epi32(0x3F800000));
+	return _mm256_sub_ps(_mm256_castsi256_ps(m), _mm256_set1_ps(1.0f));
+}
+
+__attribute__((target("avx2")))
+static size_t convert_avx2(void* dst, const float* src, size_t n, enum SampleFormat fmt, bool dither){
+	const __m256 scale = _mm256_set1_ps(format_scale(fmt));
+	const __m256 max = _mm256_set1_ps(format_max(fmt));
+	const __m256 min = _mm256_set1_ps(-format_scale(fmt));
+
+	__m256i s0 = _mm256_loadu_si256((__m256i*)seed);
+	__m256i s1 = _mm256_loadu_si256((__m256i*)(seed + 8));
+	size_t i = 0;
+
+	for(; i + 16 <= n; i += 16){
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i + 0), scale);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+
+		if(dither){
+			a = _mm256_add_ps(a, _mm256_sub_ps(uniform_avx2(&s0), uniform_avx2(&s1)));
+			b = _mm256_add_ps(b, _mm256_sub_ps(uniform_avx2(&s0), uniform_avx2(&s1)));
+		}
+
+		__m256i ia = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(a, max), min));
+		__m256i ib = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(b, max), min));
+
+		if(fmt == FMT_S16){
+			// packs works within 128-bit lanes, put the quadwords back in order
+			__m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(ia, ib), 0xD8);
+			_mm256_storeu_si256((__m256i*)((int16_t*)dst + i), p);
+		} else if(fmt == FMT_S32){
+			_mm256_storeu_si256((__m256i*)((int32_t*)dst + i + 0), ia);
+			_mm256_storeu_si256((__m256i*)((int32_t*)dst + i + 8), ib);
+		} else {
+			int32_t tmp[16];
+			_mm256_storeu_si256((__m256i*)(tmp + 0), ia);
+			_mm256_storeu_si256((__m256i*)(tmp + 8), ib);
+			for(int j = 0; j < 16; ++j) store(dst, i + j, tmp[j], fmt);
+		}
+	}
+
+	_mm256_storeu_si256((__m256i*)seed, s0);
+	_mm256_storeu_si256((__m256i*)(seed + 8), s1);
+	return i;
+}
+#endif
+
+// convert n interleaved samples into dst, which holds n * format_bytes(fmt)
+void convert_samples(void* dst, const float* src, size_t n, enum SampleFormat fmt, bool dither){
+	if(fmt == FMT_F32){
+		memcpy(dst, src, n * sizeof(float));
+		return;
+	}
+
+	dither = dither && fmt != FMT_S32;
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	static int simd = -1;
+	if(simd == -1){
+		__builtin_cpu_init();
+		simd = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse2") ? 1 : 0;
+	}
+
+	if(simd == 2){
+		done = convert_avx2(dst, src, n, fmt, dither);
+	} else if(simd == 1){
+		done = convert_sse2(dst, src, n, fmt, dither);
+	}
+#endif
+
+	convert_scalar(dst, src, done, n, fmt, dither);
+}
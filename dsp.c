@@ -0,0 +1,111 @@
+#include "minigbs.h"
+#include <math.h>
+
+// Post-mix filter chain for interleaved stereo float, run once over the mixed
+// frame instead of per channel. Each stage works on both lanes at once.
+
+typedef float v2f __attribute__((vector_size(8)));
+
+struct dsp {
+	float charge;    // DC blocker: the DMG output capacitor's per-sample charge factor
+	float lp_coeff;  // one-pole lowpass
+	float release;   // limiter gain recovery per sample
+	float gain;
+
+	v2f capacitor;
+	v2f lp;
+};
+
+#define LIMIT_THRESHOLD 0.98f
+#define LIMIT_RELEASE_S 0.05f
+
+struct dsp* dsp_new(float rate){
+	struct dsp* d = calloc(1, sizeof(*d));
+
+	d->charge  = pow(0.999958, 4194304.0 / rate);
+	d->release = expf(-1.0f / (LIMIT_RELEASE_S * rate));
+
+	if(cfg.lowpass_hz){
+		d->lp_coeff = 1.0f - expf(-2.0f * M_PI * MIN((float)cfg.lowpass_hz, rate * 0.45f) / rate);
+	}
+
+	dsp_reset(d);
+	return d;
+}
+
+void dsp_free(struct dsp* d){
+	free(d);
+}
+
+void dsp_reset(struct dsp* d){
+	d->capacitor = (v2f){};
+	d->lp = (v2f){};
+	d->gain = 1.0f;
+}
+
+// true if a frame of silence would come out as silence
+bool dsp_idle(struct dsp* d){
+	v2f s = d->capacitor * d->capacitor + d->lp * d->lp;
+	return s[0] + s[1] < 1e-10f && d->gain == 1.0f;
+}
+
+void dsp_run(struct dsp* d, float* buf, size_t frames){
+	v2f* p = (v2f*)buf;
+	v2f* end = p + frames;
+
+	if(cfg.dsp & DSP_DC_BLOCK){
+		v2f cap = d->capacitor;
+		for(v2f* s = p; s < end; ++s){
+			v2f out = *s - cap;
+			cap = *s - out * d->charge;
+			*s = out;
+		}
+		d->capacitor = cap;
+	}
+
+	if(cfg.dsp & DSP_LOWPASS && d->lp_coeff){
+		v2f lp = d->lp;
+		for(v2f* s = p; s < end; ++s){
+			lp += (*s - lp) * d->lp_coeff;
+			*s = lp;
+		}
+		d->lp = lp;
+	}
+
+	// instant attack so nothing gets past the threshold, exponential release
+	if(cfg.dsp & DSP_LIMITER){
+		float g = d->gain;
+		for(v2f* s = p; s < end; ++s){
+			float peak = MAX(fabsf((*s)[0]), fabsf((*s)[1]));
+
+			g = 1.0f - (1.0f - g) * d->release;
+			if(peak * g > LIMIT_THRESHOLD){
+				g = LIMIT_THRESHOLD / peak;
+			}
+
+			*s *= g;
+		}
+		d->gain = g > 0.99999f ? 1.0f : g;
+	}
+}
+
+// scale by *gain, moving it toward target by at most step per frame so a
+// change doesn't click. nothing to do once it's settled at 1.
+void dsp_gain(float* gain, float target, float step, float* buf, size_t frames){
+	v2f* p = (v2f*)buf;
+	v2f* end = p + frames;
+	float g = *gain;
+
+	for(; p < end && g != target; ++p){
+		g = g < target ? MIN(target, g + step) : MAX(target, g - step);
+		*p *= g;
+	}
+
+	if(g != 1.0f){
+		for(; p < end; ++p){
+			*p *= g;
+		}
+	}
+
+	*gain = g;
+}
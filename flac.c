@@ -0,0 +1,505 @@
+#include "minigbs.h"
+#include <pthread.h>
+
+// FLAC encoder for the -w backend: fixed 4096 frame blocks, fixed predictors
+// of order 0-4, partitioned Rice residuals, and whichever of the four stereo
+// decorrelation modes looks cheapest. Blocks are collected into batches that
+// worker threads encode in parallel, then written out in order. The MD5 in
+// STREAMINFO is left zero, which the format allows to mean "not computed".
+
+#define FLAC_BLOCK      4096
+#define FLAC_BATCH      32     // blocks per batch handed to the threads
+#define FLAC_MAX_THREAD 16
+#define FLAC_MAX_PORDER 8
+
+struct flac_block {
+	int32_t  pcm[2][FLAC_BLOCK];
+	uint32_t frames;
+	uint32_t index;
+
+	uint8_t* out;
+	size_t   out_size;
+};
+
+struct flac_writer {
+	FILE* file;
+	uint32_t rate;
+	int bps;
+
+	struct flac_block* blocks;
+	int nblocks;   // filled, the last one may be partial
+	uint32_t next_index;
+
+	uint64_t total_frames;
+	uint32_t min_frame_size;
+	uint32_t max_frame_size;
+
+	int nthreads;
+	int next_job;
+};
+
+/////// BIT WRITER
+
+struct bits {
+	uint8_t* buf;
+	size_t   pos;
+	uint64_t acc;
+	int      nacc;
+};
+
+static inline void bits_put(struct bits* b, uint32_t val, int n){
+	if(!n) return;
+
+	b->acc = (b->acc << n) | (val & (0xFFFFFFFFu >> (32 - n)));
+	b->nacc += n;
+
+	while(b->nacc >= 8){
+		b->nacc -= 8;
+		b->buf[b->pos++] = b->acc >> b->nacc;
+	}
+}
+
+static inline void bits_put_signed(struct bits* b, int32_t val, int n){
+	bits_put(b, (uint32_t)val, n);
+}
+
+static inline void bits_unary(struct bits* b, uint32_t zeros){
+	while(zeros >= 32){
+		bits_put(b, 0, 32);
+		zeros -= 32;
+	}
+	bits_put(b, 1, zeros + 1);
+}
+
+static void bits_align(struct bits* b){
+	if(b->nacc){
+		bits_put(b, 0, 8 - b->nacc);
+	}
+}
+
+/////// CHECKSUMS
+
+static uint8_t crc8(const uint8_t* p, size_t n){
+	uint8_t crc = 0;
+	while(n--){
+		crc ^= *p++;
+		for(int i = 0; i < 8; ++i){
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static uint16_t crc16(const uint8_t* p, size_t n){
+	uint16_t crc = 0;
+	while(n--){
+		crc ^= *p++ << 8;
+		for(int i = 0; i < 8; ++i){
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/////// SUBFRAMES
+
+// residual of the order'th fixed predictor, for samples order .. n
+static void fixed_residual(const int32_t* x, uint32_t n, int order, int64_t* res){
+	for(uint32_t i = order; i < n; ++i){
+		int64_t r;
+		switch(order){
+			case 0: r = x[i]; break;
+			case 1: r = (int64_t)x[i] - x[i-1]; break;
+			case 2: r = (int64_t)x[i] - 2*(int64_t)x[i-1] + x[i-2]; break;
+			case 3: r = (int64_t)x[i] - 3*(int64_t)x[i-1] + 3*(int64_t)x[i-2] - x[i-3]; break;
+			default: r = (int64_t)x[i] - 4*(int64_t)x[i-1] + 6*(int64_t)x[i-2] - 4*(int64_t)x[i-3] + x[i-4]; break;
+		}
+		res[i] = r;
+	}
+}
+
+static inline uint64_t zigzag(int64_t r){
+	return ((uint64_t)r << 1) ^ (uint64_t)(r >> 63);
+}
+
+// best rice parameter for a partition with n samples summing to sum (zigzagged)
+static int rice_param(uint64_t sum, uint32_t n, int max){
+	int k = 0;
+	while(k < max && ((uint64_t)n << (k + 1)) < sum){
+		++k;
+	}
+	return k;
+}
+
+static uint64_t rice_bits(uint64_t sum, uint32_t n, int k){
+	return (uint64_t)n * (k + 1) + (sum >> k);
+}
+
+struct rice_plan {
+	int order;
+	int method; // 0: 4-bit params, 1: 5-bit
+	int params[1 << FLAC_MAX_PORDER];
+	uint64_t bits;
+};
+
+// pick the partition order and parameters for res[pred .. n)
+static void rice_plan(const int64_t* res, uint32_t n, int pred, struct rice_plan* plan){
+	uint64_t sums[1 << FLAC_MAX_PORDER];
+	int max_order = 0;
+
+	while(max_order < FLAC_MAX_PORDER && (n % (2u << max_order)) == 0 && (n >> (max_order + 1)) > (uint32_t)pred){
+		++max_order;
+	}
+
+	// sums at the finest order, coarser ones are built by pairing
+	uint32_t psize = n >> max_order;
+	for(int p = 0; p < (1 << max_order); ++p){
+		uint32_t start = p ? p * psize : pred;
+		uint64_t s = 0;
+		for(uint32_t i = start; i < (p + 1) * psize; ++i){
+			s += zigzag(res[i]);
+		}
+		sums[p] = s;
+	}
+
+	plan->bits = UINT64_MAX;
+
+	for(int order = max_order; order >= 0; --order){
+		uint64_t bits = 0;
+		int params[1 << FLAC_MAX_PORDER];
+		int method = 0;
+
+		for(int p = 0; p < (1 << order); ++p){
+			uint32_t count = (n >> order) - (p ? 0 : pred);
+			int k = rice_param(sums[p], count, 30);
+			params[p] = k;
+			if(k > 14) method = 1;
+			bits += rice_bits(sums[p], count, k);
+		}
+		bits += (1 << order) * (method ? 5 : 4);
+
+		if(bits < plan->bits){
+			plan->bits = bits;
+			plan->order = order;
+			plan->method = method;
+			memcpy(plan->params, params, sizeof(int) << order);
+		}
+
+		for(int p = 0; p < (1 << order) / 2; ++p){
+			sums[p] = sums[p*2] + sums[p*2+1];
+		}
+	}
+}
+
+static void rice_write(struct bits* b, const int64_t* res, uint32_t n, int pred, const struct rice_plan* plan){
+	bits_put(b, plan->method, 2);
+	bits_put(b, plan->order, 4);
+
+	uint32_t psize = n >> plan->order;
+
+	for(int p = 0; p < (1 << plan->order); ++p){
+		int k = plan->params[p];
+		bits_put(b, k, plan->method ? 5 : 4);
+
+		for(uint32_t i = p ? p * psize : pred; i < (p + 1) * psize; ++i){
+			uint64_t u = zigzag(res[i]);
+			bits_unary(b, u >> k);
+			bits_put(b, u, k);
+		}
+	}
+}
+
+struct subframe_plan {
+	bool constant;
+	int order;
+	struct rice_plan rice;
+	uint64_t bits;
+};
+
+static void subframe_plan(const int32_t* x, uint32_t n, int bps, int64_t* res, struct subframe_plan* plan){
+	plan->constant = true;
+	for(uint32_t i = 1; i < n; ++i){
+		if(x[i] != x[0]){
+			plan->constant = false;
+			break;
+		}
+	}
+
+	if(plan->constant){
+		plan->bits = 8 + bps;
+		return;
+	}
+
+	// the usual estimate: the order with the smallest total residual wins
+	int max_order = MIN(4, (int)n - 1);
+	uint64_t best = UINT64_MAX;
+
+	for(int order = 0; order <= max_order; ++order){
+		fixed_residual(x, n, order, res);
+		uint64_t s = 0;
+		for(uint32_t i = order; i < n; ++i){
+			s += zigzag(res[i]);
+		}
+		if(s < best){
+			best = s;
+			plan->order = order;
+		}
+	}
+
+	fixed_residual(x, n, plan->order, res);
+	rice_plan(res, n, plan->order, &plan->rice);
+	plan->bits = 8 + plan->order * bps + 6 + plan->rice.bits;
+}
+
+static void subframe_write(struct bits* b, const int32_t* x, uint32_t n, int bps, int64_t* res, const struct subframe_plan* plan){
+	uint64_t verbatim = 8 + (uint64_t)n * bps;
+
+	if(plan->constant){
+		bits_put(b, 0x00, 8);
+		bits_put_signed(b, x[0], bps);
+	} else if(plan->bits >= verbatim){
+		bits_put(b, 0x01 << 1, 8);
+		for(uint32_t i = 0; i < n; ++i){
+			bits_put_signed(b, x[i], bps);
+		}
+	} else {
+		bits_put(b, (0x08 | plan->order) << 1, 8);
+		for(int i = 0; i < plan->order; ++i){
+			bits_put_signed(b, x[i], bps);
+		}
+		fixed_residual(x, n, plan->order, res);
+		rice_write(b, res, n, plan->order, &plan->rice);
+	}
+}
+
+/////// FRAMES
+
+static void utf8_put(struct bits* b, uint32_t v){
+	if(v < 0x80){
+		bits_put(b, v, 8);
+		return;
+	}
+
+	int n = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4 : v < 0x4000000 ? 5 : 6;
+	bits_put(b, (0xFF00 >> n) | (v >> (6 * (n - 1))), 8);
+	for(int i = n - 2; i >= 0; --i){
+		bits_put(b, 0x80 | ((v >> (6 * i)) & 0x3F), 8);
+	}
+}
+
+static void block_encode(struct flac_writer* w, struct flac_block* blk){
+	const uint32_t n = blk->frames;
+	int64_t* res = malloc(n * sizeof(int64_t));
+	int32_t* side = malloc(n * sizeof(int32_t));
+	int32_t* mid  = malloc(n * sizeof(int32_t));
+
+	for(uint32_t i = 0; i < n; ++i){
+		side[i] = blk->pcm[0][i] - blk->pcm[1][i];
+		mid[i]  = (blk->pcm[0][i] + blk->pcm[1][i]) >> 1;
+	}
+
+	struct subframe_plan l, r, s, m;
+	subframe_plan(blk->pcm[0], n, w->bps, res, &l);
+	subframe_plan(blk->pcm[1], n, w->bps, res, &r);
+	subframe_plan(side, n, w->bps + 1, res, &s);
+	subframe_plan(mid, n, w->bps, res, &m);
+
+	// independent, left/side, right/side, mid/side
+	uint64_t cost[4] = { l.bits + r.bits, l.bits + s.bits, r.bits + s.bits, m.bits + s.bits };
+	int mode = 0;
+	for(int i = 1; i < 4; ++i){
+		if(cost[i] < cost[mode]) mode = i;
+	}
+
+	size_t cap = 64 + (size_t)n * 2 * (w->bps + 1) / 8 + 64;
+	struct bits b = { .buf = malloc(cap) };
+
+	bits_put(&b, 0xFFF8, 16);
+	bits_put(&b, n == FLAC_BLOCK ? 12 : 7, 4);
+	bits_put(&b, 0, 4); // rate from STREAMINFO
+	bits_put(&b, (int[]){ 1, 8, 9, 10 }[mode], 4);
+	bits_put(&b, w->bps == 16 ? 4 : 6, 3);
+	bits_put(&b, 0, 1);
+	utf8_put(&b, blk->index);
+	if(n != FLAC_BLOCK){
+		bits_put(&b, n - 1, 16);
+	}
+	bits_put(&b, crc8(b.buf, b.pos), 8);
+
+	switch(mode){
+		case 0:
+			subframe_write(&b, blk->pcm[0], n, w->bps, res, &l);
+			subframe_write(&b, blk->pcm[1], n, w->bps, res, &r);
+			break;
+		case 1:
+			subframe_write(&b, blk->pcm[0], n, w->bps, res, &l);
+			subframe_write(&b, side, n, w->bps + 1, res, &s);
+			break;
+		case 2:
+			subframe_write(&b, side, n, w->bps + 1, res, &s);
+			subframe_write(&b, blk->pcm[1], n, w->bps, res, &r);
+			break;
+		case 3:
+			subframe_write(&b, mid, n, w->bps, res, &m);
+			subframe_write(&b, side, n, w->bps + 1, res, &s);
+			break;
+	}
+
+	bits_align(&b);
+	uint16_t crc = crc16(b.buf, b.pos);
+	bits_put(&b, crc, 16);
+
+	free(blk->out);
+	blk->out = b.buf;
+	blk->out_size = b.pos;
+
+	free(res);
+	free(side);
+	free(mid);
+}
+
+/////// BATCHES
+
+static void* flac_worker(void* arg){
+	struct flac_writer* w = arg;
+	int i;
+
+	while((i = __atomic_fetch_add(&w->next_job, 1, __ATOMIC_RELAXED)) < w->nblocks){
+		block_encode(w, w->blocks + i);
+	}
+
+	return NULL;
+}
+
+static void flac_flush(struct flac_writer* w){
+	if(!w->nblocks){
+		return;
+	}
+
+	pthread_t threads[FLAC_MAX_THREAD];
+	int nthreads = MIN(w->nthreads, w->nblocks) - 1;
+
+	// the jobs are shared out by next_job, so whatever workers can't be
+	// started just leave more for this thread
+	w->next_job = 0;
+	for(int i = 0; i < nthreads; ++i){
+		if(pthread_create(threads + i, NULL, flac_worker, w)){
+			debug_msg("FLAC worker not started, encoding on %d threads", i + 1);
+			nthreads = i;
+			break;
+		}
+	}
+	flac_worker(w);
+	for(int i = 0; i < nthreads; ++i){
+		pthread_join(threads[i], NULL);
+	}
+
+	for(int i = 0; i < w->nblocks; ++i){
+		struct flac_block* blk = w->blocks + i;
+		fwrite(blk->out, blk->out_size, 1, w->file);
+
+		w->min_frame_size = MIN(w->min_frame_size, (uint32_t)blk->out_size);
+		w->max_frame_size = MAX(w->max_frame_size, (uint32_t)blk->out_size);
+		w->total_frames += blk->frames;
+	}
+
+	w->blocks[0].frames = 0;
+	w->nblocks = 0;
+}
+
+/////// STREAM
+
+static void flac_streaminfo(struct flac_writer* w){
+	uint8_t buf[4 + 4 + 34] = "fLaC";
+	struct bits b = { .buf = buf, .pos = 4 };
+
+	bits_put(&b, 0x80, 8); // last metadata block, STREAMINFO
+	bits_put(&b, 34, 24);
+	bits_put(&b, FLAC_BLOCK, 16);
+	bits_put(&b, FLAC_BLOCK, 16);
+	bits_put(&b, w->min_frame_size == UINT32_MAX ? 0 : w->min_frame_size, 24);
+	bits_put(&b, w->max_frame_size, 24);
+	bits_put(&b, w->rate, 20);
+	bits_put(&b, 1, 3);
+	bits_put(&b, w->bps - 1, 5);
+	bits_put(&b, w->total_frames >> 32, 4);
+	bits_put(&b, w->total_frames, 32);
+	memset(buf + b.pos, 0, 16); // MD5 unknown
+
+	fwrite(buf, sizeof(buf), 1, w->file);
+}
+
+struct flac_writer* flac_write_begin(const char* filename, uint32_t freq, enum SampleFormat fmt){
+	if(fmt != FMT_S16 && fmt != FMT_S24){
+		fprintf(stderr, "FLAC output needs s16 or s24 samples.\n");
+		return NULL;
+	}
+
+	struct flac_writer* w = calloc(1, sizeof(*w));
+	w->rate = freq;
+	w->bps = fmt == FMT_S16 ? 16 : 24;
+	w->min_frame_size = UINT32_MAX;
+	w->blocks = calloc(FLAC_BATCH, sizeof(struct flac_block));
+	w->nthreads = MAX(1, MIN(FLAC_MAX_THREAD, (int)sysconf(_SC_NPROCESSORS_ONLN)));
+
+	w->file = fopen(filename, "w");
+	if(!w->file){
+		fprintf(stderr, "fopen(%s): %m\n", filename);
+		free(w->blocks);
+		free(w);
+		return NULL;
+	}
+
+	// placeholder, rewritten with the real sizes at the end
+	flac_streaminfo(w);
+
+	return w;
+}
+
+void flac_write_push(struct flac_writer* w, const void* samples, uint16_t period_size){
+	const int16_t* s16 = samples;
+	const uint8_t* s24 = samples;
+
+	for(uint32_t i = 0; i < period_size; ++i){
+		struct flac_block* blk = w->blocks + w->nblocks;
+
+		for(int c = 0; c < 2; ++c){
+			int32_t v;
+			if(w->bps == 16){
+				v = s16[i*2+c];
+			} else {
+				const uint8_t* p = s24 + (i*2+c) * 3;
+				v = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+			}
+			blk->pcm[c][blk->frames] = v;
+		}
+
+		if(++blk->frames == FLAC_BLOCK){
+			blk->index = w->next_index++;
+			if(++w->nblocks == FLAC_BATCH){
+				flac_flush(w);
+			} else {
+				w->blocks[w->nblocks].frames = 0;
+			}
+		}
+	}
+}
+
+void flac_write_end(struct flac_writer* w){
+	struct flac_block* last = w->blocks + w->nblocks;
+	if(last->frames){
+		last->index = w->next_index++;
+		w->nblocks++;
+	}
+	flac_flush(w);
+
+	fseek(w->file, 0, SEEK_SET);
+	flac_streaminfo(w);
+	fclose(w->file);
+
+	for(int i = 0; i < FLAC_BATCH; ++i){
+		free(w->blocks[i].out);
+	}
+	free(w->blocks);
+	free(w);
+}
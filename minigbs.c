@@ -8,6 +8,8 @@
 #include <sys/signalfd.h>
 #include <signal.h>
 #include <wordexp.h>
+#include <pthread.h>
+#include <sched.h>
 #include "minigbs.h"
 
 #if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
@@ -20,6 +22,7 @@ uint8_t* mem;
 static uint8_t* banks[32];
 static struct GBSHeader h;
 static struct regs regs;
+static uint32_t frame_cycles; // since the start of the current init/play call
 
 static void bank_switch(uint8_t which){
 	debug_msg("Bank switching to %d.", which);
@@ -38,7 +41,7 @@ static inline void mem_write(uint16_t addr, uint8_t val){
 	if(addr >= 0x2000 && addr < 0x4000){
 		bank_switch(val);
 	} else if(addr >= 0xFF10 && addr <= 0xFF40){
-		audio_write(addr, val);
+		audio_write(addr, val, frame_cycles);
 	} else if(addr < 0x8000){
 		debug_msg("rom write?: [%4x] <- [%2x]", addr, val);
 	} else if(addr == 0xFF06 || addr == 0xFF07){
@@ -60,6 +63,10 @@ static inline void mem_write(uint16_t addr, uint8_t val){
 }
 
 static inline uint8_t mem_read(uint16_t addr){
+	if(addr == 0xFF26){
+		audio_sync(); // the channel bits are set by synthesis
+	}
+
 	uint8_t val = mem[addr];
 
 	static uint8_t ortab[] = {
@@ -610,10 +617,12 @@ static void cpu_step(void){
 		regs.flags.n = regs.flags.h = 0;
 	});
 
-end:;
+end:
+	frame_cycles += cycles;
 }
 
 void cpu_frame(void){
+	frame_cycles = 0;
 
 	while(regs.sp != h.sp || regs.pc){
 		cpu_step();
@@ -624,20 +633,189 @@ void cpu_frame(void){
 	regs.pc = h.play_addr;
 	mem[regs.sp-1] = mem[regs.sp-2] = 0;
 	regs.sp -= 2;
+}
+
+static void song_start(void){
+	static const uint8_t regs_init[] = {
+		0x80, 0xBF, 0xF3, 0xFF, 0x3F, 0xFF, 0x3F, 0x00,
+		0xFF, 0x3F, 0x7F, 0xFF, 0x9F, 0xFF, 0x3F, 0xFF,
+		0xFF, 0x00, 0x00, 0x3F, 0x77, 0xF3, 0xF1,
+	};
+
+	static const uint8_t wave_init[] = {
+		0xac, 0xdd, 0xda, 0x48,
+		0x36, 0x02, 0xcf, 0x16,
+		0x2c, 0x04, 0xe5, 0x2c,
+		0xac, 0xdd, 0xda, 0x48
+	};
+
+	if(banks[0]) memcpy(mem, banks[0], 0x4000);
+	if(banks[1]) memcpy(mem + 0x4000, banks[1], 0x4000);
 
-	ui_redraw(&h);
+	memset(&regs, 0, sizeof(regs));
+	memset(mem + 0x8000, 0, 0x8000);
+	frame_cycles = 0;
+
+	memcpy(mem, mem + h.load_addr, 0x62);
+
+	mem[(h.sp-1)&0xffff] = mem[(h.sp-2)&0xffff] = 0;
+	regs.sp = h.sp - 2;
+
+	regs.pc = h.init_addr;
+	regs.a = cfg.song_no;
+
+	mem[0xffff] = 1; // IE
+	mem[0xff06] = h.tma;
+	mem[0xff07] = h.tac;
+
+	for(int i = 0; i < 23; ++i){
+		mem_write(0xFF10 + i, regs_init[i]);
+	}
+	for(int i = 0; i < 16; ++i){
+		mem_write(0xFF30 + i, wave_init[i]);
+	}
+}
+
+// render the current song through a discarding output once per quality tier
+// and report how fast each one synthesizes.
+static void benchmark(void){
+	static const char* names[QUALITY_COUNT] = { "fast", "standard", "high" };
+	audio_output = output_null;
+
+	for(int q = 0; q < QUALITY_COUNT; ++q){
+		cfg.quality = q;
+
+		struct pollfd* fds = NULL;
+		int nfds = audio_init(&fds, 0);
+
+		audio_reset();
+		song_start();
+
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		float elapsed_ms = 0;
+		while(elapsed_ms < cfg.output_duration_ms){
+			elapsed_ms += audio_update(fds, nfds);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		double audio_secs = elapsed_ms / 1000.0;
+
+		printf("%-8s: %8.3fs in %6.3fs, %12.0f samples/sec, %7.1fx realtime\n",
+		       names[q], audio_secs, secs, audio_secs * cfg.sample_rate / secs, audio_secs / secs);
+
+		audio_quit();
+		free(fds);
+	}
+}
+
+// progress messages can't go to stdout when the audio does
+static bool stdout_taken; // by -w - or -T -
+
+static FILE* info_out(void){
+	return stdout_taken ? stderr : stdout;
+}
+
+static void* pipeline_thread(void* arg){
+	while(audio_pipeline_cpu());
+	return NULL;
+}
+
+// -w: no polling or UI, just render as fast as possible. SIGINT still stops
+// early with a finished file. With a core to spare, the cpu runs ahead on a
+// thread of its own while this one synthesizes, with the same result. -c
+// instead splits the render into chunks done by processes of their own.
+static void render_offline(int sigfd){
+	uint64_t start = stats_now();
+	double elapsed_ms = 0; // float drifts by whole frames over long renders
+
+	pthread_t cpu_tid;
+	bool chunked = cfg.jobs && !cfg.stems && !cfg.debug_mode;
+	bool pipelined = !chunked && !cfg.debug_mode && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+	if(chunked){
+		audio_chunks_start(cfg.jobs);
+	}
+
+	if(pipelined){
+		audio_pipeline_start();
+
+		int err = pthread_create(&cpu_tid, NULL, pipeline_thread, NULL);
+		if(err){
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			audio_pipeline_free();
+			pipelined = false;
+		}
+	}
+
+	while(elapsed_ms < cfg.output_duration_ms && audio_output_ready(NULL, 0)){
+		double ms = audio_render_ms(cfg.output_duration_ms - elapsed_ms);
+		if(ms <= 0){
+			break;
+		}
+		elapsed_ms += ms;
+
+		struct signalfd_siginfo info;
+		if(read(sigfd, &info, sizeof(info)) == sizeof(info) && info.ssi_signo == SIGINT){
+			break;
+		}
+	}
+
+	if(pipelined){
+		audio_pipeline_stop();
+		pthread_join(cpu_tid, NULL);
+		audio_pipeline_free();
+	}
+
+	if(chunked){
+		audio_chunks_stop();
+	}
+
+	double secs = (stats_now() - start) / 1e9;
+	fprintf(info_out(), "Rendered %.3fs in %.3fs (%.1fx realtime)\n", elapsed_ms / 1000.0, secs, elapsed_ms / 1000.0 / secs);
 }
 
 static void usage(const char* argv0, FILE* out){
 	fprintf(out,
-			"Usage: %s [-dhmqswt] file [song index]\n\n"
+			"Usage: %s [-dhmqswRSTtrfDabpMPLcQFBj] file [song index]\n\n"
 			"  -h, Output this info to stdout.\n\n"
 			"  -d, Debug mode   : Dump a cpu trace to stdout, implies -q.\n"
 			"  -m, Mono mode    : Disable colors.\n"
 			"  -q, Quiet mode   : Disable UI.\n"
 			"  -s, Subdued mode : Don't flash/embolden changed registers.\n\n"
 			"  -w <file>, Write .wav to specified file instead of usual behaviour.\n"
-			"  -t <secs>, Number of seconds of audio to write (default 120).\n\n",
+			"             \"-\" or a FIFO gets a streaming .wav with no seeking,\n"
+			"             a name ending in .flac gets FLAC (s16 unless -f s24).\n"
+			"  -R       , With -w, stream headerless PCM instead of .wav.\n"
+			"  -S       , With -w, also write each channel to <file>.sq1/sq2/wave/noise.<ext>.\n"
+			"  -T [<fmt>:]<file>, Also write what's played or written to file, chosen the\n"
+			"             same way as for -w, in its own format (default f32). Repeatable.\n"
+			"             '-' is stdout, which needs -q or -w to keep the UI off it.\n"
+			"  -t <secs>, Number of seconds of audio to write (default 120).\n"
+			"  -r <hz>  , Output sample rate (default 48000).\n"
+			"  -f <fmt> , Output sample format: f32, s16, s24 or s32 (default f32 for\n"
+			"             files, the best the ALSA device takes natively otherwise).\n"
+			"  -D       , Don't dither when converting to s16 or s24.\n"
+			"  -a <dev> , ALSA device (default \"default\").\n"
+			"  -b <us>  , ALSA buffer time in microseconds (default 16667).\n"
+			"  -p <n>   , ALSA period size in frames (default a quarter of the buffer).\n"
+			"  -M       , Use mmap access, rendering straight into the ALSA buffer.\n"
+			"  -P <prio>, Run the audio thread SCHED_FIFO at this priority (1 - 99).\n"
+			"  -L <ms>  , Render this far ahead of the device on a thread of its own.\n"
+			"             Mute and speed changes are made before the ring, so they're\n"
+			"             heard this much later on top of the device latency. Volume\n"
+			"             and pausing aren't held back.\n"
+			"  -c <n>   , With -w, render 10s chunks in parallel on n processes, 0 for one\n"
+			"             per core. Matches a single pass sample for sample, short of the\n"
+			"             limiter. Not with -S.\n"
+			"  -Q <tier>, Synthesis quality: fast, standard or high (default standard).\n"
+			"  -F <list>, Post-mix filters, comma separated from dc, lowpass[=hz] and\n"
+			"             limiter, or none (default dc, none for -Q fast, lowpass\n"
+			"             defaults to 10000hz).\n"
+			"  -j <file>, Write xrun, latency and load statistics to file as JSON on exit.\n"
+			"  -B       , Benchmark each quality tier for -t seconds (default 120) and exit.\n\n",
 			argv0);
 }
 
@@ -662,20 +840,159 @@ static FILE* config_open(const char* mode){
 	return config;
 }
 
+// lines other than volume, written back untouched by config_write
+static char*  config_extra;
+static size_t config_extra_len;
+
+static int config_rate(const char* str){
+	int rate = atoi(str);
+	if(rate < 8000 || rate > 192000){
+		fprintf(stderr, "Sample rate %s out of range (8000 - 192000).\n", str);
+		exit(1);
+	}
+	return rate;
+}
+
+static int format_lookup(const char* str, size_t len){
+	static const char* names[FMT_COUNT] = {
+		[FMT_F32] = "f32",
+		[FMT_S16] = "s16",
+		[FMT_S24] = "s24",
+		[FMT_S32] = "s32",
+	};
+
+	for(int i = 0; i < FMT_COUNT; ++i){
+		if(strlen(names[i]) == len && strncmp(str, names[i], len) == 0){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static enum SampleFormat config_format(const char* str){
+	int fmt = format_lookup(str, strlen(str));
+	if(fmt == -1){
+		fprintf(stderr, "Unknown sample format '%s' (f32, s16, s24 or s32).\n", str);
+		exit(1);
+	}
+	return fmt;
+}
+
+// "[fmt:]file" for -T and recordings, format defaulting to f32 like -w
+static const char* config_sink(const char* str, enum SampleFormat* fmt){
+	const char* colon = strchr(str, ':');
+	int f = colon ? format_lookup(str, colon - str) : -1;
+
+	*fmt = f == -1 ? FMT_F32 : f;
+	return f == -1 ? str : colon + 1;
+}
+
+static enum Quality config_quality(const char* str){
+	static const char* names[QUALITY_COUNT] = {
+		[QUALITY_FAST]     = "fast",
+		[QUALITY_STANDARD] = "standard",
+		[QUALITY_HIGH]     = "high",
+	};
+
+	for(int i = 0; i < QUALITY_COUNT; ++i){
+		if(strcmp(str, names[i]) == 0){
+			return i;
+		}
+	}
+
+	fprintf(stderr, "Unknown quality '%s' (fast, standard or high).\n", str);
+	exit(1);
+}
+
+static void config_dsp(const char* str){
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s", str);
+
+	cfg.dsp = 0;
+
+	for(char* save, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		if(strcmp(tok, "dc") == 0){
+			cfg.dsp |= DSP_DC_BLOCK;
+		} else if(strncmp(tok, "lowpass", 7) == 0 && (tok[7] == '=' || !tok[7])){
+			cfg.dsp |= DSP_LOWPASS;
+			cfg.lowpass_hz = tok[7] ? atoi(tok + 8) : 10000;
+		} else if(strcmp(tok, "limiter") == 0){
+			cfg.dsp |= DSP_LIMITER;
+		} else if(strcmp(tok, "none") != 0){
+			fprintf(stderr, "Unknown filter '%s' (dc, lowpass[=hz], limiter or none).\n", tok);
+			exit(1);
+		}
+	}
+}
+
 static void config_read(void){
 	FILE* f = config_open("r");
 	if(!f) return;
 
-	char cmd[16], rest[32];
-	while(fscanf(f, "%15s %31[^\n]", cmd, rest) == 2){
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+
+	// "cmd rest of the line", of any length
+	while((n = getline(&line, &cap, f)) != -1){
+		if(n && line[n-1] == '\n') line[--n] = '\0';
+
+		char* cmd  = line + strspn(line, " \t");
+		char* rest = cmd + strcspn(cmd, " \t");
+		if(*rest) *rest++ = '\0';
+		rest += strspn(rest, " \t");
+
+		if(!*cmd || !*rest){
+			continue;
+		}
+
 		if(strcmp(cmd, "volume") == 0){
 			int v = MAX(0, MIN(100, atoi(rest)));
 			cfg.volume = v / 100.0f;
 			if(v != 100){
 				ui_msg_set("Volume: %d%%\n", v);
 			}
+			continue;
+		}
+
+		if(strcmp(cmd, "rate") == 0){
+			cfg.sample_rate = config_rate(rest);
+		} else if(strcmp(cmd, "synth_rate") == 0){
+			cfg.synth_rate = config_rate(rest);
+		} else if(strcmp(cmd, "quality") == 0){
+			cfg.quality = config_quality(rest);
+		} else if(strcmp(cmd, "dsp") == 0){
+			config_dsp(rest);
+		} else if(strcmp(cmd, "device") == 0){
+			cfg.alsa_device = strdup(rest);
+		} else if(strcmp(cmd, "buffer_time") == 0){
+			cfg.alsa_buffer_us = atoi(rest);
+		} else if(strcmp(cmd, "period_size") == 0){
+			cfg.alsa_period = atoi(rest);
+		} else if(strcmp(cmd, "mmap") == 0){
+			cfg.alsa_mmap = atoi(rest);
+		} else if(strcmp(cmd, "stats") == 0){
+			cfg.show_stats = atoi(rest);
+		} else if(strcmp(cmd, "format") == 0){
+			cfg.format = config_format(rest);
+			cfg.format_auto = false;
+		} else if(strcmp(cmd, "dither") == 0){
+			cfg.dither = atoi(rest);
+		} else if(strcmp(cmd, "lookahead") == 0){
+			cfg.lookahead_ms = atoi(rest);
+		} else if(strcmp(cmd, "realtime") == 0){
+			cfg.rt_priority = atoi(rest);
+		} else if(strcmp(cmd, "record") == 0){
+			cfg.record_filename = strdup(rest);
 		}
+
+		size_t len = strlen(cmd) + strlen(rest) + 2;
+		config_extra = realloc(config_extra, config_extra_len + len + 1);
+		sprintf(config_extra + config_extra_len, "%s %s\n", cmd, rest);
+		config_extra_len += len;
 	}
+	free(line);
 	fclose(f);
 }
 
@@ -683,15 +1000,318 @@ static void config_write(void){
 	FILE* f = config_open("w");
 	if(!f) return;
 	fprintf(f, "volume %d\n", (int)roundf(cfg.volume * 100.0f));
+	if(config_extra) fputs(config_extra, f);
 	fclose(f);
 }
 
+/////// AUDIO THREAD
+
+// Emulation, synthesis and the output device run on a thread of their own,
+// so a slow redraw or X11 flush can't make them miss a period. The UI thread
+// owns cfg and queues a command carrying the new values for anything the
+// audio side uses; only the volume is read straight from cfg, atomically, with
+// the next period. Visualization comes back the other way through audio_viz,
+// tagged with the track so the UI can skip what was queued before a change.
+//
+// With a lookahead, emulation and synthesis move to a producer thread that
+// renders ahead into a ring, and the thread on the device only copies out of
+// it. Commands then reach the sound up to lookahead_ms late, except pausing,
+// which stops the output taking from the ring, and track changes, which throw
+// away what was rendered ahead. The volume is applied on the way out of the
+// ring, so it isn't held back. Mutes are: the ring only holds the mix, and
+// keeping the channels apart in it would mean resampling and filtering each.
+
+enum CmdType {
+	CMD_QUIT,
+	CMD_TRACK,
+	CMD_PAUSE,
+	CMD_MUTE,
+	CMD_SPEED,
+};
+
+struct Cmd {
+	enum CmdType type;
+	int chan, val;
+	float speed; // CMD_SPEED, with ffwd in val
+};
+
+static struct spsc cmds;
+static int         cmd_fd;  // wakes the audio thread for a command
+static int         done_fd; // wakes the UI thread when -t runs out
+
+static struct pollfd* audio_fds; // cmd_fd, then the backend's
+static int            audio_nfds;
+
+static void cmd_push(struct Cmd cmd){
+	struct Cmd* c;
+
+	// the queue only fills if the audio thread is wedged, give it a moment
+	while(!(c = spsc_slot(&cmds))){
+		usleep(1000);
+	}
+
+	*c = cmd;
+	spsc_push(&cmds);
+	eventfd_write(cmd_fd, 1);
+}
+
+static void cmd_send(enum CmdType type, int chan, int val){
+	cmd_push((struct Cmd){ type, chan, val });
+}
+
+// run queued commands, false on CMD_QUIT. true in *restart on a track change.
+static bool cmds_run(bool* restart){
+	eventfd_t n;
+	eventfd_read(cmd_fd, &n);
+
+	for(struct Cmd* c; (c = spsc_peek(&cmds)); spsc_pop(&cmds)){
+		switch(c->type){
+			case CMD_QUIT:
+				spsc_pop(&cmds);
+				return false;
+
+			case CMD_TRACK:
+				audio_viz_track = c->val;
+				audio_reset();
+				song_start();
+				audio_ahead_flush();
+				*restart = true;
+				break;
+
+			case CMD_PAUSE:
+				audio_pause(c->val);
+				break;
+
+			case CMD_MUTE:
+				audio_mute(c->chan, c->val);
+				break;
+
+			case CMD_SPEED:
+				audio_speed(c->speed, c->val);
+				break;
+		}
+	}
+
+	return true;
+}
+
+static void* audio_thread(void* arg){
+	double elapsed_ms = 0;
+
+	while(1){
+		if(poll(audio_fds, audio_nfds, -1) == -1){
+			if(errno != EINTR) perror("poll");
+			continue;
+		}
+		stats.wakeups++;
+
+		if(audio_fds[0].revents & POLLIN){
+			bool restart = false;
+			if(!cmds_run(&restart)){
+				return NULL;
+			}
+			if(restart){
+				elapsed_ms = 0;
+			}
+		}
+
+		elapsed_ms += audio_update(audio_fds + 1, audio_nfds - 1);
+
+		if(cfg.output_duration_ms > 0 && elapsed_ms > cfg.output_duration_ms){
+			eventfd_write(done_fd, 1);
+			return NULL;
+		}
+	}
+}
+
+// with a lookahead, the audio thread renders ahead and this one plays
+static int    ahead_fd;
+static bool   ahead_quit;
+static double ahead_ms;    // rendered for -t
+static bool   ahead_ended; // end mark is in the ring
+
+// render until the ring is full, -t is used up or a command comes in
+static void ahead_render(void){
+	while(!ahead_ended && !spsc_peek(&cmds)){
+		if(cfg.output_duration_ms > 0 && ahead_ms >= cfg.output_duration_ms){
+			ahead_ended = audio_ahead_end();
+			return;
+		}
+
+		// nothing is rendered while paused, so that doesn't count toward -t
+		double ms = audio_ahead_fill();
+		if(!ms){
+			return;
+		}
+		ahead_ms += ms;
+	}
+}
+
+static void* ahead_thread(void* arg){
+	struct pollfd fds[2] = {
+		{ cmd_fd  , POLLIN },
+		{ ahead_fd, POLLIN },
+	};
+
+	while(1){
+		ahead_render();
+
+		if(poll(fds, 2, -1) == -1){
+			if(errno != EINTR) perror("poll");
+			continue;
+		}
+
+		if(fds[1].revents & POLLIN){
+			eventfd_t n;
+			eventfd_read(ahead_fd, &n);
+		}
+
+		if(fds[0].revents & POLLIN){
+			bool restart = false;
+			if(!cmds_run(&restart)){
+				return NULL;
+			}
+			// the flush took the end mark with it, if it was in the ring
+			if(restart){
+				ahead_ms = 0;
+				ahead_ended = false;
+			}
+		}
+	}
+}
+
+static void* output_thread(void* arg){
+	while(!__atomic_load_n(&ahead_quit, __ATOMIC_ACQUIRE)){
+		if(poll(audio_fds + 1, audio_nfds - 1, -1) == -1){
+			if(errno != EINTR) perror("poll");
+			continue;
+		}
+		stats.wakeups++;
+
+		audio_update(audio_fds + 1, audio_nfds - 1);
+
+		if(audio_ahead_done()){
+			eventfd_write(done_fd, 1);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static pthread_t audio_tid;
+static pthread_t output_tid;
+
+static void thread_start(pthread_t* tid, void* (*fn)(void*)){
+	int err = pthread_create(tid, NULL, fn, NULL);
+	if(err){
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+
+	if(cfg.rt_priority){
+		struct sched_param sp = { .sched_priority = cfg.rt_priority };
+		err = pthread_setschedparam(*tid, SCHED_FIFO, &sp);
+		if(err){
+			ui_msg_set("No realtime priority: %s\n", strerror(err));
+		}
+	}
+}
+
+static void audio_thread_start(void){
+	spsc_init(&cmds, sizeof(struct Cmd), 64);
+	spsc_init(&audio_viz, sizeof(struct Viz), 16);
+
+	if(!cfg.lookahead_ms){
+		thread_start(&audio_tid, audio_thread);
+		return;
+	}
+
+	// fill the ring before the device starts asking for it
+	ahead_fd = audio_ahead_start(cfg.lookahead_ms);
+	ahead_render();
+
+	thread_start(&audio_tid, ahead_thread);
+	thread_start(&output_tid, output_thread);
+}
+
+static void audio_thread_stop(void){
+	cmd_send(CMD_QUIT, 0, 0);
+	pthread_join(audio_tid, NULL);
+
+	if(cfg.lookahead_ms){
+		__atomic_store_n(&ahead_quit, true, __ATOMIC_RELEASE);
+		pthread_join(output_tid, NULL);
+	}
+}
+
+// start or stop a recording of what's playing, named by strftime from the
+// "record" config line. the file is opened and closed on this thread, the
+// audio thread only feeds it while it's tapped.
+static struct audio_output* recording;
+static struct audio_output* rec_closing;
+static uint64_t             rec_closing_ticket;
+
+static void record_poll(bool force){
+	if(rec_closing && (force || audio_output_released(rec_closing_ticket))){
+		audio_output_close(rec_closing);
+		rec_closing = NULL;
+	}
+}
+
+static void record_toggle(void){
+	if(recording){
+		rec_closing = recording;
+		rec_closing_ticket = audio_output_untap(recording);
+		recording = NULL;
+		ui_msg_set("Recording stopped\n");
+		return;
+	}
+
+	if(rec_closing){
+		ui_msg_set("Still finishing the last recording\n");
+		return;
+	}
+
+	const char* pattern = cfg.record_filename ? cfg.record_filename : "minigbs-%Y%m%d-%H%M%S.wav";
+	enum SampleFormat fmt;
+	pattern = config_sink(pattern, &fmt);
+
+	char name[256];
+	time_t now = time(NULL);
+	strftime(name, sizeof(name), pattern, localtime(&now));
+
+	recording = audio_output_open(audio_output_for(name), name, fmt);
+	if(recording && !audio_output_tap(recording)){
+		audio_output_close(recording);
+		recording = NULL;
+	}
+
+	if(recording){
+		ui_msg_set("Recording to %s\n", name);
+	} else {
+		ui_msg_set("Can't record to %s\n", name);
+	}
+}
+
 int main(int argc, char** argv){
 	setlocale(LC_ALL, "");
 	char* prog = argv[0];
 
 	int opt;
-	while((opt = getopt(argc, argv, "dhmqsw:t:")) != -1){
+	int rate = 0;
+
+	int quality = -1;
+	const char* dsp = NULL;
+	int format = -1;
+	bool no_dither = false;
+	const char* device = NULL;
+	int buffer_us = 0, period = 0;
+	bool use_mmap = false;
+	const char* tees[4];
+	int ntees = 0;
+
+	while((opt = getopt(argc, argv, "dhmqsw:RST:t:r:f:Da:b:p:MP:L:c:Q:F:Bj:")) != -1){
 		switch(opt){
 			case 'd':
 				cfg.hide_ui = true;
@@ -712,10 +1332,70 @@ int main(int argc, char** argv){
 			case 'w':
 				cfg.write_wav = true;
 				cfg.output_filename = strdup(optarg);
+				stdout_taken |= strcmp(optarg, "-") == 0;
+				break;
+			case 'R':
+				cfg.raw = true;
+				break;
+			case 'S':
+				cfg.stems = true;
+				break;
+			case 'T':
+				if(ntees == countof(tees)){
+					fprintf(stderr, "At most %zu -T outputs.\n", countof(tees));
+					return 1;
+				}
+				tees[ntees++] = optarg;
+
+				enum SampleFormat fmt;
+				stdout_taken |= strcmp(config_sink(optarg, &fmt), "-") == 0;
 				break;
 			case 't':
 				cfg.output_duration_ms = strtof(optarg, NULL) * 1000.0f;
 				break;
+			case 'r':
+				rate = config_rate(optarg);
+				break;
+			case 'Q':
+				quality = config_quality(optarg);
+				break;
+			case 'f':
+				format = config_format(optarg);
+				break;
+			case 'D':
+				no_dither = true;
+				break;
+			case 'a':
+				device = optarg;
+				break;
+			case 'b':
+				buffer_us = atoi(optarg);
+				break;
+			case 'p':
+				period = atoi(optarg);
+				break;
+			case 'M':
+				use_mmap = true;
+				break;
+			case 'P':
+				cfg.rt_priority = atoi(optarg);
+				break;
+			case 'L':
+				cfg.lookahead_ms = atoi(optarg);
+				break;
+			case 'c':
+				cfg.jobs = atoi(optarg) > 0 ? atoi(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+				break;
+			case 'F':
+				dsp = optarg;
+				break;
+			case 'j':
+				cfg.stats_filename = optarg;
+				break;
+			case 'B':
+				cfg.benchmark = true;
+				cfg.hide_ui = true;
+				break;
 			default:
 				usage(prog, stderr);
 				return 1;
@@ -816,31 +1496,73 @@ int main(int argc, char** argv){
 	}
 	fclose(f);
 
-	static const uint8_t regs_init[] = {
-		0x80, 0xBF, 0xF3, 0xFF, 0x3F, 0xFF, 0x3F, 0x00,
-		0xFF, 0x3F, 0x7F, 0xFF, 0x9F, 0xFF, 0x3F, 0xFF,
-		0xFF, 0x00, 0x00, 0x3F, 0x77, 0xF3, 0xF1,
-	};
-
-	static const uint8_t wave_init[] = {
-		0xac, 0xdd, 0xda, 0x48,
-		0x36, 0x02, 0xcf, 0x16,
-		0x2c, 0x04, 0xe5, 0x2c,
-		0xac, 0xdd, 0xda, 0x48
-	};
-
 	mem[0xff06] = h.tma;
 	mem[0xff07] = h.tac;
 
 	cfg.volume = 1.0f;
 	cfg.speed  = 1.0f;
+	cfg.ffwd   = 1;
+	cfg.sample_rate = 48000;
+	cfg.quality = QUALITY_STANDARD;
+	cfg.dsp = -1; // picked once the quality is known
+	cfg.dither = true;
+	cfg.format_auto = true;
 
 	config_read();
 
+	if(rate){
+		cfg.sample_rate = rate;
+	}
+
+	if(quality >= 0){
+		cfg.quality = quality;
+	}
+
+	if(dsp){
+		config_dsp(dsp);
+	}
+
+	// the fast tier is the bare nearest-step output, no DC blocker either
+	if(cfg.dsp == -1){
+		cfg.dsp = cfg.quality == QUALITY_FAST ? 0 : DSP_DC_BLOCK;
+	}
+
+	if(format >= 0){
+		cfg.format = format;
+		cfg.format_auto = false;
+	}
+
+	if(no_dither){
+		cfg.dither = false;
+	}
+
+	if(device)    cfg.alsa_device = device;
+	if(buffer_us) cfg.alsa_buffer_us = buffer_us;
+	if(period)    cfg.alsa_period = period;
+	if(use_mmap)  cfg.alsa_mmap = true;
+
+	if(cfg.benchmark){
+		if(cfg.output_duration_ms <= 0){
+			cfg.output_duration_ms = 2 * 60 * 1000.0f;
+		}
+		benchmark();
+		return 0;
+	}
+
 	if(cfg.write_wav) {
-		audio_output = output_wav;
+		audio_output = cfg.raw ? output_pipe : audio_output_for(cfg.output_filename);
+
+		if(audio_output == output_pipe && cfg.stems){
+			fprintf(stderr, "Stems need a file to go next to, not a stream.\n");
+			exit(1);
+		}
 	} else {
 		audio_output = output_alsa;
+
+		if(cfg.stems){
+			fprintf(stderr, "Stems are only written with -w.\n");
+			exit(1);
+		}
 	}
 
 	if(!audio_output->interactive) {
@@ -856,11 +1578,17 @@ int main(int argc, char** argv){
 			cfg.output_duration_ms = 2 * 60 * 1000.0f;
 		}
 
-		printf("Writing %gs of audio to %s...\n", cfg.output_duration_ms / 1000.0f, cfg.output_filename);
+		fprintf(info_out(), "Writing %gs of audio to %s...\n", cfg.output_duration_ms / 1000.0f, cfg.output_filename);
 
 		audio_output->filename = cfg.output_filename;
 	}
 
+	// the UI draws on stdout, and the tap would set it non-blocking under curses
+	if(stdout_taken && !cfg.hide_ui) {
+		fprintf(stderr, "-T - needs -q or -w, the UI is on stdout.\n");
+		exit(1);
+	}
+
 	if(!cfg.hide_ui) {
 		initscr();
 	}
@@ -886,71 +1614,69 @@ int main(int argc, char** argv){
 		FD_SIGNAL,
 		FD_DRAW_TIMER,
 		FD_GUI,
+		FD_AUDIO_DONE,
 	};
 
-#define NFDS 4
-	struct pollfd* fds = calloc(NFDS, sizeof(struct pollfd));
-	{
-		struct pollfd tmp[NFDS] = {
-			[FD_STDIN]      = { STDIN_FILENO , POLLIN },
-			[FD_SIGNAL]     = { sigfd        , POLLIN },
-			[FD_DRAW_TIMER] = { draw_timer   , POLLIN },
-			[FD_GUI]        = { ui_init()    , POLLIN },
-		};
-		memcpy(fds, tmp, sizeof(tmp));
-	}
+	cmd_fd  = eventfd(0, 0);
+	done_fd = eventfd(0, 0);
+
+#define NFDS 5
+	struct pollfd fds[NFDS] = {
+		[FD_STDIN]      = { STDIN_FILENO , POLLIN },
+		[FD_SIGNAL]     = { sigfd        , POLLIN },
+		[FD_DRAW_TIMER] = { draw_timer   , POLLIN },
+		[FD_GUI]        = { ui_init(&h)  , POLLIN },
+		[FD_AUDIO_DONE] = { done_fd      , POLLIN },
+	};
 
-	int nfds = audio_init(&fds, NFDS);
+	audio_fds = calloc(1, sizeof(struct pollfd));
+	audio_fds[0] = (struct pollfd){ cmd_fd, POLLIN };
+	audio_nfds = audio_init(&audio_fds, 1);
+
+	for(int i = 0; i < ntees; ++i){
+		enum SampleFormat fmt;
+		const char* file = config_sink(tees[i], &fmt);
+		struct audio_output* out = audio_output_open(audio_output_for(file), file, fmt);
+
+		if(!out || !audio_output_tap(out)){
+			fprintf(stderr, "Can't write to %s.\n", file);
+			exit(1);
+		}
+	}
 
 	// hack to avoid ALSA warnings breaking the UI
 	if(!cfg.hide_ui){
 		fclose(stderr);
 	}
 
-	bool paused;
-	float elapsed_ms;
+	bool paused = false;
+	bool muted[4] = {};
+	bool threaded = false;
+	uint32_t track = 0; // audio_viz_track once the audio side catches up
+
+	stats_reset();
 
-restart:
-	elapsed_ms = 0;
 	audio_reset();
 	ui_reset();
+	song_start();
+	audio_pause(false);
 
-	if(banks[0]) memcpy(mem, banks[0], 0x4000);
-	if(banks[1]) memcpy(mem + 0x4000, banks[1], 0x4000);
-
-	memset(&regs, 0, sizeof(regs));
-	memset(mem + 0x8000, 0, 0x8000);
-
-	memcpy(mem, mem + h.load_addr, 0x62);
-
-	mem[(h.sp-1)&0xffff] = mem[(h.sp-2)&0xffff] = 0;
-	regs.sp = h.sp - 2;
-
-	regs.pc = h.init_addr;
-	regs.a = cfg.song_no;
-
-	mem[0xffff] = 1; // IE
-	mem[0xff06] = h.tma;
-	mem[0xff07] = h.tac;
-
-	for(int i = 0; i < 23; ++i){
-		mem_write(0xFF10 + i, regs_init[i]);
+	if(!audio_output->interactive){
+		render_offline(sigfd);
+		goto end;
 	}
-	memcpy(mem + 0xff30, wave_init, 16);
 
-	paused = false;
-	audio_pause(false);
+	audio_thread_start();
+	threaded = true;
 
 	while(1){
-		int n = poll(fds, nfds, -1);
+		int n = poll(fds, NFDS, -1);
 		if(n == -1){
 			perror("poll");
 			continue;
 		}
 
-		elapsed_ms += audio_update(fds + NFDS, nfds - NFDS);
-
-		if(cfg.output_duration_ms > 0 && elapsed_ms > cfg.output_duration_ms) {
+		if(fds[FD_AUDIO_DONE].revents & POLLIN){
 			goto end;
 		}
 
@@ -984,6 +1710,14 @@ restart:
 
 		if(fds[FD_DRAW_TIMER].revents & POLLIN){
 			fd_clear(draw_timer);
+
+			for(struct Viz* v; (v = spsc_peek(&audio_viz)); spsc_pop(&audio_viz)){
+				if(v->track == track) ui_viz(v);
+			}
+
+			record_poll(false);
+			stats_tick();
+			ui_redraw();
 			ui_refresh();
 		}
 
@@ -997,9 +1731,12 @@ restart:
 					goto end;
 
 				case ACT_CHAN_TOGGLE:
+					muted[value - 1] = !muted[value - 1];
+					stats_control();
+					cmd_send(CMD_MUTE, value, muted[value - 1]);
 					ui_msg_set("Channel %c %smuted\n",
 							   value + '0',
-							   audio_mute(value, -1) ? "" : "un");
+							   muted[value - 1] ? "" : "un");
 					break;
 
 				case ACT_TRACK_SET:
@@ -1007,34 +1744,65 @@ restart:
 						ui_msg_set("Out of range.\n");
 					} else {
 						cfg.song_no = value;
-						goto restart;
+						ui_reset();
+						cmd_send(CMD_TRACK, 0, ++track);
+
+						paused = false;
+						cmd_send(CMD_PAUSE, 0, false);
 					}
 					break;
 
 				case ACT_PAUSE:
 					paused = !paused;
 					ui_msg_set("%s\n", paused ? "Paused" : "Resumed");
-					audio_pause(paused);
+					cmd_send(CMD_PAUSE, 0, paused);
 					break;
 
 				case ACT_VOL:
-					cfg.volume = value / 100.0f;
+					if(value / 100.0f != cfg.volume) stats_control();
+					__atomic_store(&cfg.volume, &(float){ value / 100.0f }, __ATOMIC_RELAXED);
 					ui_msg_set("Volume: %d%%\n", value);
 					break;
 
 				case ACT_SPEED:
-					cfg.speed = value ? MAX(0.1f, MIN(2.0f, cfg.speed + value / 100.0f)) : 1.0f;
+					cfg.speed = value ? MAX(SPEED_MIN, MIN(SPEED_MAX, cfg.speed + value / 100.0f)) : 1.0f;
 					ui_msg_set("Speed: %d%%\n", (int)roundf(100.0f * cfg.speed));
-					audio_update_rate();
+					cmd_push((struct Cmd){ CMD_SPEED, .val = cfg.ffwd, .speed = cfg.speed });
+					break;
+
+				case ACT_RECORD:
+					record_toggle();
+					break;
+
+				case ACT_FFWD:
+					cfg.ffwd = value;
+					cmd_push((struct Cmd){ CMD_SPEED, .val = cfg.ffwd, .speed = cfg.speed });
+					if(value > 1){
+						ui_msg_set("Fast-forward: %dx\n", value);
+					} else {
+						ui_msg_set("Fast-forward off\n");
+					}
 					break;
 			}
 		}
 	}
 
 end:
+	if(threaded){
+		// nothing's writing any more
+		audio_thread_stop();
+		audio_output_taps_stop();
+		record_poll(true);
+	}
+
 	config_write();
 	ui_quit();
 	audio_quit();
+	free(audio_fds);
+
+	if(cfg.stats_filename){
+		stats_dump(cfg.stats_filename);
+	}
 
 	return 0;
 }
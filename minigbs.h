@@ -21,44 +21,180 @@ void debug_msg       (const char* fmt, ...);
 int  audio_init        (struct pollfd**, int);
 void audio_quit        (void);
 float audio_update     (struct pollfd*, int);
+double audio_render_ms (double ms);
+int    audio_ahead_start (int ms);
+double audio_ahead_fill  (void);
+void   audio_ahead_flush (void);
+bool   audio_ahead_end   (void);
+bool   audio_ahead_done  (void);
+void audio_pipeline_start (void);
+bool audio_pipeline_cpu   (void);
+void audio_pipeline_stop  (void);
+void audio_pipeline_free  (void);
+void audio_sync           (void);
+void audio_chunks_start   (int jobs);
+void audio_chunks_stop    (void);
 void audio_reset       (void);
-void audio_write       (uint16_t addr, uint8_t val);
+void audio_write       (uint16_t addr, uint8_t val, uint32_t cycle);
 void audio_pause       (bool);
 bool audio_mute        (int chan, int val);
 void audio_update_rate (void);
+void audio_speed       (float speed, int ffwd);
 void audio_get_notes   (uint16_t[static 4]);
 void audio_get_vol     (uint8_t vol[static 8]);
+float audio_out_rate   (void);
+
+enum SampleFormat {
+	FMT_F32,
+	FMT_S16,
+	FMT_S24, // packed, 3 bytes
+	FMT_S32,
+
+	FMT_COUNT,
+};
+
+size_t format_bytes    (enum SampleFormat);
+void   convert_samples (void* dst, const float* src, size_t n, enum SampleFormat, bool dither);
 
 struct audio_output {
 	const bool interactive;
+	const size_t size; // of the backend's struct, for opening it more than once as a tap
 
-	uint16_t (*init)  (struct audio_output*, struct pollfd** fds, int* nfds, float freq);
+	// init returns the period size, 0 if it failed. may change *freq and format.
+	uint16_t (*init)  (struct audio_output*, struct pollfd** fds, int* nfds, float* freq);
 	void     (*quit)  (struct audio_output*);
 	bool     (*ready) (struct audio_output*, struct pollfd* fds, int nfds);
-	void     (*write) (struct audio_output*, const float* samples, uint16_t period_size);
+	void     (*write) (struct audio_output*, const void* samples, uint16_t period_size); // in format
+
+	// optional, for backends that can be written in place: up to *frames
+	// frames of format to fill, then commit how many were.
+	void*    (*begin)  (struct audio_output*, uint16_t* frames);
+	void     (*commit) (struct audio_output*, uint16_t frames);
 
 	const char* filename; // to be set by main code if interactive is false
+	enum SampleFormat format;
 };
 
-uint16_t audio_output_init  (struct pollfd**, int* nfds, float freq);
+uint16_t audio_output_init  (struct pollfd**, int* nfds, float* freq);
 void     audio_output_quit  (void);
 bool     audio_output_ready (struct pollfd* fds, int nfds);
-void     audio_output_write (const float* samples, uint16_t period_size);
+float*   audio_output_begin  (uint16_t* frames);
+void     audio_output_commit (float* samples, uint16_t frames);
+
+// file and stream sinks fed the same samples as audio_output, each in its own
+// format. opening returns the sink or NULL and tapping starts feeding it.
+// tapping and untapping are safe from another thread while audio plays, but
+// an untapped sink may only be closed once audio_output_released says so.
+struct audio_output* audio_output_for      (const char* filename);
+struct audio_output* audio_output_open     (struct audio_output*, const char* filename, enum SampleFormat);
+bool                 audio_output_tap      (struct audio_output*);
+uint64_t             audio_output_untap    (struct audio_output*);
+bool                 audio_output_released (uint64_t ticket);
+void                 audio_output_close    (struct audio_output*);
+void                 audio_output_taps_stop(void);
 
 extern struct audio_output* audio_output;
 extern struct audio_output* output_alsa;
 extern struct audio_output* output_wav;
+extern struct audio_output* output_null;
+extern struct audio_output* output_pipe;
+extern struct audio_output* output_flac;
+
+struct resampler;
+struct resampler* resampler_new   (float in_rate, float out_rate);
+void              resampler_free  (struct resampler*);
+void              resampler_reset (struct resampler*);
+void              resampler_skip  (struct resampler*, double in_frames);
+size_t            resampler_run   (struct resampler*, const float* in, size_t* in_frames, float* out, size_t out_frames);
+
+struct Stats {
+	uint64_t xruns;
+	long     delay;     // frames queued in the device after the last write
+	long     delay_max;
+
+	uint64_t cpu_frames;
+	uint64_t cpu_ns;    // in cpu_frame
+	uint64_t synth_windows;
+	uint64_t synth_ns;  // in synth_frame
+
+	uint64_t periods;
+	uint64_t wakeups;   // poll returns
 
-int  ui_init      (void);
+	size_t   ahead_frames;    // rendered ahead after the last period
+	size_t   ahead_min;       // lowest that's been, not counting flushes
+	uint64_t ahead_underruns; // periods the ring ran dry
+
+	double   control_ms;     // from the last volume or mute key to hearing it
+	double   control_ms_max;
+
+	// over the last second, from stats_tick
+	double wakeups_per_sec;
+	double cpu_load;
+	double synth_load;
+};
+
+extern struct Stats stats;
+
+uint64_t stats_now   (void);
+void     stats_reset (void);
+void     stats_tick  (void);
+void     stats_dump  (const char* filename);
+void     stats_control (void);
+void     stats_heard   (double queued_ms);
+
+void stems_begin (const char* filename, float synth_rate, float out_rate);
+void stems_push  (int chan, const float* samples, size_t frames);
+void stems_sync  (uint64_t mix_frames);
+void stems_end   (void);
+
+struct dsp;
+struct dsp* dsp_new   (float rate);
+void        dsp_free  (struct dsp*);
+void        dsp_reset (struct dsp*);
+bool        dsp_idle  (struct dsp*);
+void        dsp_run   (struct dsp*, float* buf, size_t frames);
+void        dsp_gain  (float* gain, float target, float step, float* buf, size_t frames);
+
+struct spsc {
+	uint8_t* buf;
+	size_t elem, mask, count;
+	size_t head __attribute__((aligned(64))); // written by the producer
+	size_t tail __attribute__((aligned(64))); // written by the consumer
+};
+
+void  spsc_init (struct spsc*, size_t elem, size_t count);
+void  spsc_free (struct spsc*);
+void* spsc_slot (struct spsc*); // producer: item to fill, NULL if full
+void  spsc_push (struct spsc*); // producer: publish the filled item
+void* spsc_peek (struct spsc*); // consumer: oldest item, NULL if empty
+void  spsc_pop  (struct spsc*); // consumer: done with it
+size_t spsc_count(struct spsc*);
+
+// what the UI needs from one synthesized window, sent from the audio thread
+#define VIZ_OSC 2048
+
+struct Viz {
+	uint16_t notes[4];
+	uint8_t  vol[8];
+	uint8_t  regs[0x30];    // FF10 - FF3F
+	uint8_t  written[0x30]; // boldness for registers that changed
+	uint16_t osc_count;
+	float    osc[4][VIZ_OSC]; // mono, the last osc_count frames of the window
+	uint32_t track; // audio_viz_track when it was made
+};
+
+extern struct spsc audio_viz; // of struct Viz, filled once its buf is set up
+extern uint32_t    audio_viz_track; // from CMD_TRACK, so the UI can drop the old track's
+
+int  ui_init      (struct GBSHeader*);
 void ui_msg_set   (const char* fmt, ...);
-void ui_regs_set  (uint16_t addr, int val);
+void ui_viz       (const struct Viz*);
 void ui_chart_set (uint16_t[static 3]);
-void ui_redraw    (struct GBSHeader*);
+void ui_redraw    (void);
 void ui_refresh   (void);
 void ui_quit      (void);
 void ui_reset     (void);
 int  ui_cmd       (int key);
-void ui_osc_draw  (int chan, float* samples, size_t n);
 int  ui_action    (int* val, bool* tui, bool* x11);
 
 extern bool ui_in_cmd_mode;
@@ -104,6 +240,20 @@ enum UIMode {
 	UI_MODE_COUNT,
 };
 
+enum Quality {
+	QUALITY_FAST,     // nearest step, no DC blocker unless asked for
+	QUALITY_STANDARD, // integrated steps
+	QUALITY_HIGH,     // integrated at HIGH_OVERSAMPLE times the rate, then resampled
+
+	QUALITY_COUNT,
+};
+
+enum DSPStage {
+	DSP_DC_BLOCK = 1 << 0, // the DMG's output capacitor
+	DSP_LOWPASS  = 1 << 1, // one-pole at lowpass_hz
+	DSP_LIMITER  = 1 << 2,
+};
+
 enum UIAction {
 	ACT_QUIT,
 	ACT_CHAN_TOGGLE,
@@ -111,6 +261,8 @@ enum UIAction {
 	ACT_PAUSE,
 	ACT_VOL,
 	ACT_SPEED,
+	ACT_FFWD,
+	ACT_RECORD,
 };
 
 struct Config {
@@ -120,6 +272,8 @@ struct Config {
 	bool subdued;
 
 	bool write_wav;
+	bool raw; // headerless PCM when streaming
+	bool stems;
 
 	const char* output_filename;
 	float output_duration_ms;
@@ -127,14 +281,43 @@ struct Config {
 	int song_no;
 	int song_count;
 
+	bool benchmark;
+
+	int sample_rate; // output rate
+	int synth_rate;  // internal rate, 0 to pick one from sample_rate
+	enum Quality quality;
+
+	const char* alsa_device;
+	int alsa_buffer_us;
+	int alsa_period;  // frames, 0 for a quarter of the buffer
+	bool alsa_mmap;
+
+	enum SampleFormat format; // what the output backends get
+	bool format_auto;         // not asked for, backends may pick another
+	bool dither;
+
+	int rt_priority;  // SCHED_FIFO priority of the audio thread, 0 for none
+	int lookahead_ms; // rendered ahead of the output on its own thread, 0 for none
+	int jobs;         // processes -w renders chunks on, 0 for a single pass
+
+	int dsp;        // DSPStage bits
+	int lowpass_hz;
+
 	float volume; // 0.0f - 1.0f
-	float speed;  // 0.0f - 1.0f
+	float speed;  // SPEED_MIN - SPEED_MAX
+	int   ffwd;   // play calls per synthesized one, 1 when not fast-forwarding
 
 	enum UIMode ui_mode;
+	bool show_stats;
+	const char* stats_filename; // json written here on exit
+	const char* record_filename; // strftime pattern, [fmt:] prefix allowed
 
 	int win_w, win_h;
 };
 
+#define SPEED_MIN 0.1f
+#define SPEED_MAX 2.0f
+
 extern struct Config cfg;
 extern uint8_t* mem;
 
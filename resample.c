@@ -0,0 +1,137 @@
+#include "minigbs.h"
+#include <math.h>
+
+// Polyphase windowed-sinc resampler for interleaved stereo float.
+// The kernel is tabulated at RS_PHASES sub-sample offsets and linearly
+// interpolated between neighbouring phases, so any ratio works.
+
+#define RS_TAPS   64
+#define RS_PHASES 256
+#define RS_BLOCK  1024
+
+struct resampler {
+	double step;   // input frames per output frame
+	double frac;   // position of the next output between two input frames
+	size_t pos;    // buffer index of the first tap for the next output
+	size_t fill;   // frames in buf
+
+	float kernel[RS_PHASES+1][RS_TAPS];
+	float buf[(RS_TAPS + RS_BLOCK) * 2];
+};
+
+static double bessel_i0(double x){
+	double sum = 1.0, term = 1.0;
+	for(int k = 1; k < 32; ++k){
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+struct resampler* resampler_new(float in_rate, float out_rate){
+	struct resampler* r = calloc(1, sizeof(*r));
+	r->step = in_rate / (double)out_rate;
+
+	// cut off a little under the lower of the two nyquist frequencies
+	const double fc = 0.45 * MIN(1.0, 1.0 / r->step);
+	const double beta = 9.0;
+	const double half = RS_TAPS / 2;
+
+	for(int p = 0; p <= RS_PHASES; ++p){
+		double frac = p / (double)RS_PHASES;
+		double total = 0.0;
+		double taps[RS_TAPS];
+
+		for(int k = 0; k < RS_TAPS; ++k){
+			double x = k - (half - 1) - frac;
+			double s = x == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+			double w = x / half;
+			w = (fabs(w) < 1.0) ? bessel_i0(beta * sqrt(1.0 - w * w)) / bessel_i0(beta) : 0.0;
+
+			taps[k] = s * w;
+			total += taps[k];
+		}
+
+		for(int k = 0; k < RS_TAPS; ++k){
+			r->kernel[p][k] = taps[k] / total;
+		}
+	}
+
+	resampler_reset(r);
+	return r;
+}
+
+void resampler_free(struct resampler* r){
+	free(r);
+}
+
+void resampler_reset(struct resampler* r){
+	r->frac = 0.0;
+	r->pos  = 0;
+
+	// half a kernel of silence so the first output lines up with the first input
+	r->fill = RS_TAPS / 2 - 1;
+	memset(r->buf, 0, sizeof(r->buf));
+}
+
+// start the next output in_frames into the input instead of at its first
+// frame, for picking up a stream partway. only right after a reset.
+void resampler_skip(struct resampler* r, double in_frames){
+	r->pos  = in_frames;
+	r->frac = in_frames - r->pos;
+}
+
+size_t resampler_run(struct resampler* r, const float* in, size_t* in_frames, float* out, size_t out_frames){
+	const size_t cap = RS_TAPS + RS_BLOCK;
+	size_t consumed = 0;
+	size_t produced = 0;
+
+	while(produced < out_frames){
+		if(r->pos + RS_TAPS > r->fill){
+			if(consumed == *in_frames){
+				break;
+			}
+
+			// drop frames no future output can reach, then top up from the input
+			size_t drop = MIN(r->pos, r->fill);
+			if(drop){
+				memmove(r->buf, r->buf + drop * 2, (r->fill - drop) * 2 * sizeof(float));
+				r->fill -= drop;
+				r->pos  -= drop;
+			}
+
+			size_t n = MIN(cap - r->fill, *in_frames - consumed);
+			memcpy(r->buf + r->fill * 2, in + consumed * 2, n * 2 * sizeof(float));
+			r->fill += n;
+			consumed += n;
+			continue;
+		}
+
+		double p = r->frac * RS_PHASES;
+		int    ph = (int)p;
+		float  a = p - ph;
+
+		const float* k0 = r->kernel[ph];
+		const float* k1 = r->kernel[ph+1];
+		const float* src = r->buf + r->pos * 2;
+
+		float l = 0.0f, rr = 0.0f;
+		for(int k = 0; k < RS_TAPS; ++k){
+			float c = k0[k] + (k1[k] - k0[k]) * a;
+			l  += src[k*2+0] * c;
+			rr += src[k*2+1] * c;
+		}
+
+		out[produced*2+0] = l;
+		out[produced*2+1] = rr;
+		++produced;
+
+		r->frac += r->step;
+		size_t whole = (size_t)r->frac;
+		r->frac -= whole;
+		r->pos += whole;
+	}
+
+	*in_frames = consumed;
+	return produced;
+}
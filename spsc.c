@@ -0,0 +1,60 @@
+#include "minigbs.h"
+
+// Single producer, single consumer ring of fixed size items, for passing work
+// between the audio thread and the UI thread without locks. Items are filled
+// and read in place: slot/push on the producer side, peek/pop on the consumer
+// side. Each index is only written by its own side, and the release/acquire
+// pair on it publishes the item.
+
+void spsc_init(struct spsc* q, size_t elem, size_t count){
+	// storage for a power of two, so the indices can run free and wrap with
+	// a mask, but only count of them in use at once
+	size_t n = 1;
+	while(n < count) n <<= 1;
+
+	q->buf   = calloc(n, elem);
+	q->elem  = elem;
+	q->mask  = n - 1;
+	q->count = count;
+	q->head  = q->tail = 0;
+}
+
+void spsc_free(struct spsc* q){
+	free(q->buf);
+	q->buf = NULL;
+}
+
+void* spsc_slot(struct spsc* q){
+	size_t head = q->head;
+	size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if(head - tail >= q->count){
+		return NULL;
+	}
+
+	return q->buf + (head & q->mask) * q->elem;
+}
+
+void spsc_push(struct spsc* q){
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+void* spsc_peek(struct spsc* q){
+	size_t tail = q->tail;
+	size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	if(head == tail){
+		return NULL;
+	}
+
+	return q->buf + (tail & q->mask) * q->elem;
+}
+
+void spsc_pop(struct spsc* q){
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+// items in the queue, as of the call
+size_t spsc_count(struct spsc* q){
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,104 @@
+#include "minigbs.h"
+#include <time.h>
+#include <inttypes.h>
+
+// Counters for telling emulation cost apart from scheduling trouble. The
+// totals run for the whole session, the rates are redone once a second.
+
+struct Stats stats;
+
+static uint64_t start_ns;
+static uint64_t last_ns;
+static struct Stats last;
+static uint64_t control_ns; // when the UI changed a control, 0 once it's heard
+
+uint64_t stats_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+void stats_reset(void){
+	memset(&stats, 0, sizeof(stats));
+	last = stats;
+	start_ns = last_ns = stats_now();
+}
+
+void stats_tick(void){
+	uint64_t now = stats_now();
+	uint64_t dt = now - last_ns;
+
+	if(dt < UINT64_C(1000000000)){
+		return;
+	}
+
+	stats.wakeups_per_sec = (stats.wakeups - last.wakeups) * 1e9 / dt;
+	stats.cpu_load   = (double)(stats.cpu_ns - last.cpu_ns) / dt;
+	stats.synth_load = (double)(stats.synth_ns - last.synth_ns) / dt;
+
+	last = stats;
+	last_ns = now;
+}
+
+// UI side: a volume or mute change was just made
+void stats_control(void){
+	__atomic_store_n(&control_ns, stats_now(), __ATOMIC_RELAXED);
+}
+
+// audio side: the change is applied to samples that play after queued_ms
+void stats_heard(double queued_ms){
+	uint64_t t = __atomic_exchange_n(&control_ns, 0, __ATOMIC_RELAXED);
+	if(!t){
+		return;
+	}
+
+	stats.control_ms = (stats_now() - t) / 1e6 + queued_ms;
+	stats.control_ms_max = MAX(stats.control_ms_max, stats.control_ms);
+}
+
+void stats_dump(const char* filename){
+	FILE* f = fopen(filename, "w");
+	if(!f){
+		return;
+	}
+
+	double secs = (stats_now() - start_ns) / 1e9;
+
+	fprintf(f,
+	        "{\n"
+	        "  \"seconds\": %.3f,\n"
+	        "  \"xruns\": %" PRIu64 ",\n"
+	        "  \"delay_frames\": %ld,\n"
+	        "  \"delay_max_frames\": %ld,\n"
+	        "  \"cpu_frames\": %" PRIu64 ",\n"
+	        "  \"cpu_seconds\": %.6f,\n"
+	        "  \"synth_windows\": %" PRIu64 ",\n"
+	        "  \"synth_seconds\": %.6f,\n"
+	        "  \"periods\": %" PRIu64 ",\n"
+	        "  \"wakeups\": %" PRIu64 ",\n"
+	        "  \"wakeups_per_sec\": %.1f,\n"
+	        "  \"ahead_frames\": %zu,\n"
+	        "  \"ahead_min_frames\": %zu,\n"
+	        "  \"ahead_underruns\": %" PRIu64 ",\n"
+	        "  \"control_ms\": %.3f,\n"
+	        "  \"control_max_ms\": %.3f\n"
+	        "}\n",
+	        secs,
+	        stats.xruns,
+	        stats.delay,
+	        stats.delay_max,
+	        stats.cpu_frames,
+	        stats.cpu_ns / 1e9,
+	        stats.synth_windows,
+	        stats.synth_ns / 1e9,
+	        stats.periods,
+	        stats.wakeups,
+	        secs > 0 ? stats.wakeups / secs : 0.0,
+	        stats.ahead_frames,
+	        stats.ahead_min,
+	        stats.ahead_underruns,
+	        stats.control_ms,
+	        stats.control_ms_max);
+
+	fclose(f);
+}
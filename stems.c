@@ -0,0 +1,174 @@
+#include "minigbs.h"
+
+// Per-channel stems written next to the -w output from the same pass: each
+// channel's synthesized buffer gets its own filter chain and resampler, then
+// waits in a queue until the mix has been written that far, so every stem
+// ends up exactly as long as the mix.
+
+struct wav_writer;
+struct wav_writer* wav_write_begin(const char* filename, uint32_t freq, enum SampleFormat fmt);
+void wav_write_push (struct wav_writer* wav, const void* samples, uint16_t period_size);
+void wav_write_end  (struct wav_writer* wav);
+
+struct flac_writer;
+struct flac_writer* flac_write_begin(const char* filename, uint32_t freq, enum SampleFormat fmt);
+void flac_write_push (struct flac_writer* flac, const void* samples, uint16_t period_size);
+void flac_write_end  (struct flac_writer* flac);
+
+static const char* stem_names[4] = { "sq1", "sq2", "wave", "noise" };
+
+static struct stem {
+	struct dsp* dsp;
+	struct resampler* resampler;
+	struct wav_writer* wav;
+	struct flac_writer* flac;
+
+	float* queue; // at the output rate
+	size_t fill, cap;
+} stems[4];
+
+static bool     active;
+static float    ratio;   // output frames per synthesized frame
+static float*   scratch;
+static size_t   scratch_cap;
+static uint8_t* convert;
+static uint64_t written;
+
+static void* grow(void* p, size_t* cap, size_t want, size_t size){
+	if(want > *cap){
+		*cap = want * 2;
+		p = realloc(p, *cap * size);
+	}
+	return p;
+}
+
+void stems_begin(const char* filename, float synth_rate, float out_rate){
+	const char* ext = strrchr(filename, '.');
+	const char* slash = strrchr(filename, '/');
+	if(!ext || (slash && ext < slash)){
+		ext = filename + strlen(filename);
+	}
+
+	bool flac = strcasecmp(ext, ".flac") == 0;
+
+	for(int i = 0; i < 4; ++i){
+		struct stem* s = stems + i;
+		char name[4096];
+		snprintf(name, sizeof(name), "%.*s.%s%s", (int)(ext - filename), filename, stem_names[i], ext);
+
+		if(flac){
+			s->flac = flac_write_begin(name, out_rate, cfg.format);
+		} else {
+			s->wav = wav_write_begin(name, out_rate, cfg.format);
+		}
+
+		if(!s->flac && !s->wav){
+			fprintf(stderr, "Error opening stem file %s\n", name);
+			exit(1);
+		}
+
+		s->dsp = dsp_new(synth_rate);
+		if(synth_rate != out_rate){
+			s->resampler = resampler_new(synth_rate, out_rate);
+		}
+	}
+
+	ratio = out_rate / synth_rate;
+	written = 0;
+	active = true;
+}
+
+// one channel's buffer for the window just synthesized, NULL if it was silent
+void stems_push(int chan, const float* samples, size_t frames){
+	if(!active) return;
+
+	struct stem* s = stems + chan;
+
+	scratch = grow(scratch, &scratch_cap, frames * 2, sizeof(float));
+	if(samples){
+		memcpy(scratch, samples, frames * 2 * sizeof(float));
+	} else {
+		memset(scratch, 0, frames * 2 * sizeof(float));
+	}
+	dsp_run(s->dsp, scratch, frames);
+
+	size_t room = frames * ratio + 2;
+	s->queue = grow(s->queue, &s->cap, (s->fill + room) * 2, sizeof(float));
+
+	if(s->resampler){
+		const float* in = scratch;
+		while(frames){
+			size_t n = frames;
+			size_t out = resampler_run(s->resampler, in, &n, s->queue + s->fill * 2, s->cap / 2 - s->fill);
+			s->fill += out;
+			in += n * 2;
+			frames -= n;
+
+			if(!n && !out){
+				s->queue = grow(s->queue, &s->cap, s->cap + room * 2, sizeof(float));
+			}
+		}
+	} else {
+		memcpy(s->queue + s->fill * 2, scratch, frames * 2 * sizeof(float));
+		s->fill += frames;
+	}
+}
+
+// write every stem up to mix_frames, the number of frames of mix written so far
+void stems_sync(uint64_t mix_frames){
+	if(!active) return;
+
+	size_t n = mix_frames - written;
+	for(int i = 0; i < 4; ++i){
+		n = MIN(n, stems[i].fill);
+	}
+	if(!n) return;
+
+	static size_t convert_cap;
+	convert = grow(convert, &convert_cap, n * 2 * format_bytes(cfg.format), 1);
+
+	for(int i = 0; i < 4; ++i){
+		struct stem* s = stems + i;
+
+		for(size_t done = 0; done < n;){
+			uint16_t chunk = MIN(n - done, (size_t)UINT16_MAX);
+			convert_samples(convert, s->queue + done * 2, chunk * 2, cfg.format, cfg.dither);
+
+			if(s->flac){
+				flac_write_push(s->flac, convert, chunk);
+			} else {
+				wav_write_push(s->wav, convert, chunk);
+			}
+			done += chunk;
+		}
+
+		memmove(s->queue, s->queue + n * 2, (s->fill - n) * 2 * sizeof(float));
+		s->fill -= n;
+	}
+
+	written += n;
+}
+
+void stems_end(void){
+	if(!active) return;
+
+	for(int i = 0; i < 4; ++i){
+		struct stem* s = stems + i;
+
+		if(s->flac){
+			flac_write_end(s->flac);
+		} else {
+			wav_write_end(s->wav);
+		}
+
+		dsp_free(s->dsp);
+		if(s->resampler){
+			resampler_free(s->resampler);
+		}
+		free(s->queue);
+
+		memset(s, 0, sizeof(*s));
+	}
+
+	active = false;
+}
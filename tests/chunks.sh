@@ -0,0 +1,17 @@
+#!/bin/sh
+# a chunked render (-c) has to come out sample for sample like a single pass
+set -e
+bin=${1:-./minigbs}
+gbs=${2:-gbs/pocket.gbs}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for q in fast standard high; do
+	"$bin" -Q $q -t 35 -w "$dir/single.wav" "$gbs" > /dev/null
+	"$bin" -Q $q -t 35 -c 3 -w "$dir/chunked.wav" "$gbs" > /dev/null
+	if ! cmp -s "$dir/single.wav" "$dir/chunked.wav"; then
+		echo "chunks: -Q $q -c 3 differs from a single pass" >&2
+		exit 1
+	fi
+	echo "chunks: -Q $q ok"
+done
@@ -3,6 +3,7 @@
 #include <float.h>
 #include <assert.h>
 #include <math.h>
+#include <inttypes.h>
 
 int  x11_init       (void);
 int  x11_action     (bool*);
@@ -26,6 +27,12 @@ static int msg_timer;
 static char msg[128];
 static char input[32];
 static char* input_ptr = input;
+static struct GBSHeader* header;
+
+// the latest window from the audio thread
+static uint16_t viz_notes[4] = { 0xffff, 0xffff, 0xffff, 0xffff };
+static uint8_t  viz_vol[8];
+static uint8_t  viz_regs[0x30];
 
 void ui_chart_set(uint16_t notes[static 3]){
 	if(++col >= &grid[0] + GRID_W){
@@ -105,6 +112,37 @@ static void ui_msg_draw(void){
 	}
 }
 
+static void ui_stats_draw(void){
+	if(!cfg.show_stats){
+		return;
+	}
+
+	move(cfg.win_h-2, 0);
+	clrtoeol();
+
+	float rate = audio_out_rate();
+
+	attron(A_DIM);
+	printw("xruns %" PRIu64 "  delay %.1fms  cpu %.1f%%  synth %.1f%%  wakeups %.0f/s",
+	       stats.xruns,
+	       stats.delay * 1000.0f / rate,
+	       stats.cpu_load * 100.0,
+	       stats.synth_load * 100.0,
+	       stats.wakeups_per_sec);
+
+	if(cfg.lookahead_ms){
+		printw("  ahead %.1fms (min %.1fms, dry %" PRIu64 ")",
+		       stats.ahead_frames * 1000.0f / rate,
+		       stats.ahead_min * 1000.0f / rate,
+		       stats.ahead_underruns);
+	}
+
+	if(stats.control_ms_max){
+		printw("  ctl %.1fms (max %.1fms)", stats.control_ms, stats.control_ms_max);
+	}
+	attroff(A_DIM);
+}
+
 static void ui_info_draw(struct GBSHeader* h){
 	char buf[256] = {};
 	int len = 0;
@@ -134,10 +172,6 @@ static void ui_info_draw(struct GBSHeader* h){
 	attroff(A_BOLD);
 }
 
-void ui_regs_set(uint16_t addr, int val){
-	boldness[addr - 0xFF10] = val;
-}
-
 static void ui_regs_draw(void){
 	static const int color_map[3][16] = {
 		{ 1, 1, 1, 1, 1, 5, 2, 2, 2, 2, 3, 3, 3, 3, 3, 5 },
@@ -166,7 +200,7 @@ static void ui_regs_draw(void){
 			}
 
 			attron(COLOR_PAIR(color_map[i][j]));
-			printw(" %02x", mem[0xFF10 + (i*0x10) + j]);
+			printw(" %02x", viz_regs[i*0x10 + j]);
 			attroff(COLOR_PAIR(color_map[i][j]));
 
 			if(boldness[i*16+j]){
@@ -177,7 +211,9 @@ static void ui_regs_draw(void){
 	}
 }
 
-int ui_init(void){
+int ui_init(struct GBSHeader* h){
+	header = h;
+
 	if(cfg.hide_ui)
 		return -1;
 
@@ -252,7 +288,7 @@ static void ui_volume_draw(uint16_t notes[static 4]){
 
 	static uint8_t prev_vol[8];
 	uint8_t vol[8];
-	audio_get_vol(vol);
+	memcpy(vol, viz_vol, sizeof(vol));
 
 	for(int i = 0; i < 8; ++i){
 		if(notes[i/2] == 0xffff) vol[i] = 0;
@@ -334,36 +370,48 @@ static ssize_t osc_find_transition(float* start, float* end){
 	return off;
 }
 
-void ui_osc_draw(int chan, float* samples, size_t count){
+static void ui_osc_push(int chan, const float* samples, size_t count){
 	struct osc_chan* c = osc_chans + chan;
 
-	count /= 2;
-
 	if(count > OSC_SAMPLES){
-		samples += 2 * (count - OSC_SAMPLES);
+		samples += count - OSC_SAMPLES;
 		count = OSC_SAMPLES;
 	}
 
 	size_t copy_count = OSC_SAMPLES - count;
 	memmove(c->samples, c->samples + count, copy_count * sizeof(float));
+	memcpy(c->samples + copy_count, samples, count * sizeof(float));
+}
 
-	for(size_t i = 0; i < count; ++i){
-		float s = ((samples[i*2] + samples[i*2+1]) / 2.0f);// * 1.2f * height;
-		c->samples[copy_count + i] = s;
+// take in one window's worth of state, in the order they were synthesized
+void ui_viz(const struct Viz* v){
+	for(int i = 0; i < 4; ++i){
+		ui_osc_push(i, v->osc[i], v->osc_count);
 	}
+
+	for(size_t i = 0; i < sizeof(v->written); ++i){
+		if(v->written[i]){
+			boldness[i] = v->written[i];
+		}
+	}
+
+	memcpy(viz_notes, v->notes, sizeof(viz_notes));
+	memcpy(viz_vol, v->vol, sizeof(viz_vol));
+	memcpy(viz_regs, v->regs, sizeof(viz_regs));
+
+	ui_chart_set(viz_notes);
 }
 
-void ui_redraw(struct GBSHeader* h){
+void ui_redraw(void){
 	if(cfg.hide_ui) return;
 
-	uint16_t notes[4] = {};
-	audio_get_notes(notes);
-	ui_chart_set(notes);
+	uint16_t notes[4];
+	memcpy(notes, viz_notes, sizeof(notes));
 
 	if(cfg.ui_mode == UI_MODE_CHART){
 		ui_chart_draw();
 	} else {
-		ui_info_draw(h);
+		ui_info_draw(header);
 		ui_regs_draw();
 
 		if(cfg.ui_mode == UI_MODE_REGISTERS){
@@ -406,6 +454,7 @@ void ui_refresh(void){
 	x11_draw_end();
 	if(cfg.hide_ui) return;
 
+	ui_stats_draw();
 	ui_msg_draw();
 	refresh();
 }
@@ -520,6 +569,14 @@ int ui_action(int* out_val, bool* tui_events, bool* x11_events){
 			erase();
 			break;
 
+		case 'i':
+			cfg.show_stats = !cfg.show_stats;
+			if(!cfg.show_stats){
+				move(cfg.win_h-2, 0);
+				clrtoeol();
+			}
+			break;
+
 		case 'v':
 			cfg.ui_mode = (cfg.ui_mode != UI_MODE_VOLUME) ? UI_MODE_VOLUME : UI_MODE_REGISTERS;
 			erase();
@@ -551,6 +608,13 @@ int ui_action(int* out_val, bool* tui_events, bool* x11_events){
 			*out_val = 5;
 			return ACT_SPEED;
 
+		case 'f':
+			*out_val = cfg.ffwd >= 32 ? 1 : MAX(8, cfg.ffwd * 2);
+			return ACT_FFWD;
+
+		case 'w':
+			return ACT_RECORD;
+
 		case KEY_BACKSPACE: {
 			if(ui_in_cmd_mode){
 				ui_cmd(key);
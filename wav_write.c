@@ -1,10 +1,26 @@
 #include "minigbs.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// Samples go through a sliding MAP_SHARED window over the file, whose extent
+// is reserved ahead with fallocate. The header carries a JUNK chunk the size
+// of a ds64 chunk, so files that outgrow 32-bit sizes can be turned into RF64
+// in place when they're finished.
+
+#define WAV_WINDOW (64 << 20)
 
 struct wav_header {
 	uint8_t  riff_magic[4];
 	uint32_t chunk_size;
 	uint8_t  wave_magic[4];
 
+	uint8_t  junk_magic[4]; // "ds64" for RF64
+	uint32_t junk_size;
+	uint64_t rf64_riff_size;
+	uint64_t rf64_data_size;
+	uint64_t rf64_sample_count;
+	uint32_t rf64_table_length;
+
 	uint8_t  fmt_magic[4];
 	uint32_t fmt_size;
 	uint16_t format;
@@ -16,61 +32,166 @@ struct wav_header {
 
 	uint8_t  data_magic[4];
 	uint32_t data_size;
-};
+} __attribute__((packed));
 
 struct wav_writer {
 	struct wav_header header;
-	FILE* file;
-	uint32_t data_size;
+	int fd;
+	uint64_t data_size;
+	uint32_t frame_size;
+
+	uint8_t* map;
+	off_t    map_off;  // file offset of map, WAV_WINDOW aligned
+	off_t    reserved; // file is allocated up to here
+	bool     failed;   // out of space or similar, the rest is dropped
 };
 
-struct wav_writer* wav_write_begin(const char* filename, uint32_t freq) {
+static struct wav_header wav_header_init(uint32_t freq, enum SampleFormat fmt) {
+	uint32_t size = format_bytes(fmt);
+
+	return (struct wav_header){
+		.riff_magic = "RIFF",
+		.wave_magic = "WAVE",
+		.junk_magic = "JUNK",
+		.junk_size  = 28,
+		.fmt_magic  = "fmt ",
+		.fmt_size   = 16,
+		.format     = fmt == FMT_F32 ? 3 : 1,
+		.nchannels  = 2,
+		.sample_rate = freq,
+		.byte_rate = freq * 2 * size,
+		.block_align = 2 * size,
+		.bits_per_sample = size * 8,
+		.data_magic = "data",
+	};
+}
+
+// header for a stream of unknown length, with the sizes maxed out the way
+// readers of piped WAV expect. returns the header size.
+size_t wav_stream_header(void* out, uint32_t freq, enum SampleFormat fmt) {
+	struct wav_header h = wav_header_init(freq, fmt);
+	h.chunk_size = UINT32_MAX;
+	h.data_size  = UINT32_MAX;
+
+	memcpy(out, &h, sizeof(h));
+	return sizeof(h);
+}
+
+struct wav_writer* wav_write_begin(const char* filename, uint32_t freq, enum SampleFormat fmt) {
 	struct wav_writer* wav = calloc(1, sizeof(struct wav_writer));
 
 	*wav = (struct wav_writer){
-		.header = {
-			.riff_magic = "RIFF",
-			.wave_magic = "WAVE",
-			.fmt_magic  = "fmt ",
-			.fmt_size   = 16,
-			.format     = 3,
-			.nchannels  = 2,
-			.sample_rate = freq,
-			.byte_rate = freq * 2 * sizeof(float),
-			.block_align = 2 * sizeof(float),
-			.bits_per_sample = sizeof(float) * 8,
-			.data_magic = "data",
-		},
+		.header = wav_header_init(freq, fmt),
+		.frame_size = 2 * format_bytes(fmt),
+		.map = MAP_FAILED,
 	};
 
-	wav->file = fopen(filename, "w");
-	if(!wav->file) {
-		fprintf(stderr, "fopen(%s): %m\n", filename);
+	wav->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(wav->fd == -1) {
+		fprintf(stderr, "open(%s): %m\n", filename);
+		free(wav);
 		return NULL;
 	}
 
-	fwrite(&wav->header, sizeof(wav->header), 1, wav->file);
+	if(write(wav->fd, &wav->header, sizeof(wav->header)) != sizeof(wav->header)) {
+		fprintf(stderr, "write(%s): %m\n", filename);
+		close(wav->fd);
+		free(wav);
+		return NULL;
+	}
 
 	return wav;
 }
 
-void wav_write_push(struct wav_writer* wav, const float* samples, uint16_t period_size) {
-	uint32_t size = period_size * sizeof(float) * 2;
-	wav->data_size += size;
-	fwrite(samples, size, 1, wav->file);
+// make sure the window holding file offset pos is mapped
+static bool wav_map(struct wav_writer* wav, off_t pos) {
+	off_t off = pos & ~(off_t)(WAV_WINDOW - 1);
+
+	if(wav->map != MAP_FAILED && wav->map_off == off) {
+		return true;
+	}
+
+	if(wav->map != MAP_FAILED) {
+		munmap(wav->map, WAV_WINDOW);
+		wav->map = MAP_FAILED;
+	}
+
+	// reserve a whole window at a time so the extents come out large. a sparse
+	// file is only a fallback for filesystems without fallocate: on a full disk
+	// it would turn into SIGBUS on the memcpy instead of an error here.
+	if(wav->reserved < off + WAV_WINDOW) {
+		if(fallocate(wav->fd, 0, off, WAV_WINDOW) == -1) {
+			if((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(wav->fd, off + WAV_WINDOW) == -1) {
+				fprintf(stderr, "Error growing .wav file: %m\n");
+				return false;
+			}
+		}
+		wav->reserved = off + WAV_WINDOW;
+	}
+
+	wav->map = mmap(NULL, WAV_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, wav->fd, off);
+	wav->map_off = off;
+
+	if(wav->map == MAP_FAILED) {
+		fprintf(stderr, "Error mapping .wav file: %m\n");
+		return false;
+	}
+
+	return true;
+}
+
+void wav_write_push(struct wav_writer* wav, const void* samples, uint16_t period_size) {
+	const uint8_t* src = samples;
+	size_t size = period_size * wav->frame_size;
+
+	while(size && !wav->failed) {
+		off_t pos = sizeof(wav->header) + wav->data_size;
+		if(!wav_map(wav, pos)) {
+			// wav_write_end still finishes the header for what made it
+			wav->failed = true;
+			return;
+		}
+
+		size_t n = MIN(size, (size_t)(wav->map_off + WAV_WINDOW - pos));
+		memcpy(wav->map + (pos - wav->map_off), src, n);
+
+		wav->data_size += n;
+		src += n;
+		size -= n;
+	}
 }
 
 void wav_write_end(struct wav_writer* wav) {
+	if(wav->map != MAP_FAILED) {
+		munmap(wav->map, WAV_WINDOW);
+	}
 
-	uint32_t size = 36 + wav->data_size;
-	fseek(wav->file, 4, SEEK_SET);
-	fwrite(&size, 4, 1, wav->file);
+	// give back what was reserved but not written
+	off_t end = sizeof(wav->header) + wav->data_size;
+	if(ftruncate(wav->fd, end) == -1) {
+		fprintf(stderr, "Error truncating .wav file: %m\n");
+	}
+
+	uint64_t riff_size = end - 8;
+	struct wav_header* h = &wav->header;
 
-	fseek(wav->file, 40, SEEK_SET);
-	fwrite(&wav->data_size, 4, 1, wav->file);
+	if(riff_size > UINT32_MAX) {
+		memcpy(h->riff_magic, "RF64", 4);
+		memcpy(h->junk_magic, "ds64", 4);
+		h->chunk_size        = UINT32_MAX;
+		h->data_size         = UINT32_MAX;
+		h->rf64_riff_size    = riff_size;
+		h->rf64_data_size    = wav->data_size;
+		h->rf64_sample_count = wav->data_size / wav->frame_size;
+	} else {
+		h->chunk_size = riff_size;
+		h->data_size  = wav->data_size;
+	}
 
-	fflush(wav->file);
-	fclose(wav->file);
+	if(pwrite(wav->fd, h, sizeof(*h), 0) != sizeof(*h)) {
+		fprintf(stderr, "Error writing .wav header: %m\n");
+	}
 
+	close(wav->fd);
 	free(wav);
 }